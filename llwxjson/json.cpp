@@ -6,157 +6,782 @@
 //
 
 #include "json.hpp"
+#include <atomic>
 #include <iostream>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_WIN
+#include <io.h>
+#include <intrin.h>
+#define open _open
+#define read _read
+#define close _close
+#else
+#include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#endif
+
+#ifndef S_ISREG
+#define S_ISREG(m) (((m) & S_IFMT) == S_IFREG)
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
 
 using namespace std;
 
 // ---------------------------------------------------------------------------
 static void assertValid(const char* ptr, const char* body) {
     if (ptr == nullptr) {
-        std::cerr << "Invalid json near " << body << endl;
-        abort();
+        throw JsonError(string("Invalid json near ") + body);
     }
 }
 
 // ---------------------------------------------------------------------------
-// Parse json word surrounded by quotes.
-static void getJsonWord( JsonBuffer& buffer, char delim, JsonToken& word) {
-
-    const char* lastPtr = strchr(buffer.ptr(), delim);
-    while (lastPtr != nullptr && lastPtr[-1] == '\\') {
-        lastPtr = strchr(lastPtr + 1, delim);
+// Open and load file, "-" is stdin.
+bool JsonBuffer::load(const char* path) {
+    if (strcmp(path, "-") == 0) {
+#ifdef HAVE_WIN
+        _setmode(0, O_BINARY);
+#endif
+        return load(0);
     }
-    assertValid(lastPtr,  buffer.ptr());
-    word.clear();
-    int len = int(lastPtr - buffer.ptr());
-    word.append(buffer.ptr(len + 1), len);
-    word.isQuoted = true;
+    int fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = load(fd);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return ok;
 }
 
 // ---------------------------------------------------------------------------
-// Parse json array
-static void getJsonArray(JsonBuffer& buffer, JsonArray& array) {
-    JsonFields jsonFields;
-    for(;;) {
-        JsonToken token = JsonParse(buffer, jsonFields);
-        if (token.mToken == JsonToken::Value) {
-            if (! token.empty()) {
-                JsonValue* jsonValue = new JsonValue(token);
-                array.push_back(jsonValue);
-            } else {
-                if (jsonFields.size() == 1 && jsonFields.cbegin()->first.empty()) {
-                    array.push_back(jsonFields.cbegin()->second);
-                } else {
-                    JsonValue* jsonValue = new JsonValue(token);
-                    array.push_back(jsonValue);
-                }
-                jsonFields.clear();
+// Map regular files, read() anything else (pipes, stdin, small files).
+bool JsonBuffer::load(int fd) {
+    unmap();
+    mStore.clear();
+
+    struct stat filestat;
+    size_t expect = 0;
+    if (fstat(fd, &filestat) == 0 && S_ISREG(filestat.st_mode)) {
+        expect = (size_t)filestat.st_size;
+#ifndef HAVE_WIN
+        if (expect >= MMAP_MIN) {
+            void* map = mmap(nullptr, expect, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, expect, MADV_SEQUENTIAL);
+                madvise(map, expect, MADV_WILLNEED);
+                mMap = map;
+                mMapLen = expect;
+                mData = (const char*)map;
+                mSize = expect;
+                return true;
             }
+        }
+#endif
+    }
 
-        } else {
-            return;
+    mStore.resize(std::max(expect + 1, (size_t)4096));
+    size_t inCnt = 0;
+    for (;;) {
+        if (inCnt == mStore.size()) {
+            mStore.resize(mStore.size() * 2);
+        }
+        long got = read(fd, mStore.data() + inCnt, (unsigned)(mStore.size() - inCnt));
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
         }
+        if (got == 0)
+            break;
+        inCnt += got;
     }
+    mStore.resize(inCnt);
+    mData = mStore.data();
+    mSize = inCnt;
+    return true;
 }
 
 // ---------------------------------------------------------------------------
-// Parse json group
-static void getJsonGroup(JsonBuffer& buffer, JsonFields& fields) {
-
-    for(;;) {
-        JsonToken token = JsonParse(buffer, fields);
-        if (token.mToken == JsonToken::EndGroup) {
-            return;
-        }
+void JsonBuffer::unmap() {
+#ifndef HAVE_WIN
+    if (mMap != nullptr) {
+        munmap(mMap, mMapLen);
     }
+#endif
+    mMap = nullptr;
+    mMapLen = 0;
+    mData = "";
+    mSize = 0;
 }
 
 // ---------------------------------------------------------------------------
-static void addJsonValue(JsonFields& jsonFields, JsonToken& fieldName, JsonToken& value) {
-    if (! fieldName.empty() /* && !value.empty() */ ) {
-        jsonFields[fieldName] = new JsonToken(value);
+// Shared key table. Each thread first checks a small direct mapped cache
+// of entries it has seen, the shared table is only locked on a cache miss.
+static const size_t KEY_CACHE_SIZE = 1024;
+
+static std::mutex keyMutex;
+static std::unordered_multimap<uint64_t, const JsonKeyHeader*> keyTable;
+static std::atomic<uint32_t> keyCount(0);
+static thread_local const JsonKeyHeader* keyCache[KEY_CACHE_SIZE];
+
+static inline bool keyMatch(const JsonKeyHeader* entry, uint64_t hash, const char* str, size_t len) {
+    return entry != nullptr && entry->hash == hash && entry->len == len
+        && memcmp(entry + 1, str, len) == 0;
+}
+
+void JsonKeys::intern(JsonValue& name) {
+    size_t len = name.length();
+    if (len == 0 || len > MAX_LEN || name.isKey())
+        return;
+    uint64_t hash = JsonValueHash::hash(name.data(), len);
+    const JsonKeyHeader*& cached = keyCache[hash % KEY_CACHE_SIZE];
+    if (! keyMatch(cached, hash, name.data(), len)) {
+        std::lock_guard<std::mutex> lock(keyMutex);
+        const JsonKeyHeader* found = nullptr;
+        auto range = keyTable.equal_range(hash);
+        for (auto it = range.first; it != range.second && found == nullptr; ++it) {
+            if (keyMatch(it->second, hash, name.data(), len))
+                found = it->second;
+        }
+        if (found == nullptr) {
+            if (keyCount >= MAX_KEYS)
+                return;
+            static JsonArena storage;       // process lifetime
+            JsonKeyHeader* entry = (JsonKeyHeader*)storage.alloc(sizeof(JsonKeyHeader) + len + 1, alignof(JsonKeyHeader));
+            entry->hash = hash;
+            entry->id = ++keyCount;
+            entry->len = (uint32_t)len;
+            char* text = (char*)(entry + 1);
+            memcpy(text, name.data(), len);
+            text[len] = '\0';
+            keyTable.emplace(hash, entry);
+            found = entry;
+        }
+        cached = found;
     }
-    fieldName.clear();
-    value.clear();
+    name.mPtr = (const char*)(cached + 1);
+    name.scalar = JsonKey;
+}
+
+uint32_t JsonKeys::count() {
+    return keyCount;
 }
 
 // ---------------------------------------------------------------------------
-JsonToken JsonParse(JsonBuffer& buffer, JsonFields& jsonFields) {
+// Stage 1 - structural scanner.
+//
+// Input is classified 64 bytes at a time into bit masks (one bit per byte)
+// with SIMD compares when available. Bit arithmetic on the masks resolves
+// escapes and string spans, the result is the offset of every quote,
+// structural character { } [ ] : , outside strings, and first byte of each
+// bare scalar (number, true, false, null).
 
-    JsonToken fieldName = "";
-    JsonToken fieldValue;
-    JsonToken tmpValue;
+struct JsonMasks {
+    uint64_t quote;
+    uint64_t backslash;
+    uint64_t op;            // { } [ ] : ,
+    uint64_t space;         // space, tab, cr, lf
+};
 
-    while (buffer.pos < buffer.size()) {
-        char chr = buffer.nextChr();
+typedef void (*JsonClassify)(const char* ptr, JsonMasks& masks);
 
-        switch (chr) {
-        default:
-            fieldValue += chr;
+static void classifyScalar(const char* ptr, JsonMasks& masks) {
+    masks.quote = masks.backslash = masks.op = masks.space = 0;
+    for (unsigned idx = 0; idx < 64; idx++) {
+        uint64_t bit = uint64_t(1) << idx;
+        switch (ptr[idx]) {
+        case '"':  masks.quote |= bit; break;
+        case '\\': masks.backslash |= bit; break;
+        case '{': case '}': case '[': case ']': case ':': case ',':
+            masks.op |= bit;
             break;
-
-        case ' ':
-        case '\t':
-        case '\n':
-        case '\r':
-            // addJsonValue(jsonFields, fieldName, fieldValue);
+        case ' ': case '\t': case '\n': case '\r':
+            masks.space |= bit;
             break;
-        case ',':
-            tmpValue = fieldValue;
-            addJsonValue(jsonFields, fieldName, fieldValue);
-            return tmpValue;
+        }
+    }
+}
 
-        case ':':
-            fieldName = fieldValue;
-            fieldValue.clear();
-            break;
+#if defined(__x86_64__) || defined(_M_X64)
+#define HAVE_JSON_SIMD
+#include <immintrin.h>
 
-        case '{': {
-            JsonFields* pJsonFields = new JsonFields();
-            jsonFields[fieldName] = pJsonFields;
-            fieldName.clear();
-            getJsonGroup(buffer, *pJsonFields);
+static void classifySse2(const char* ptr, JsonMasks& masks) {
+    masks.quote = masks.backslash = masks.op = masks.space = 0;
+    for (unsigned off = 0; off < 64; off += 16) {
+        __m128i chrs = _mm_loadu_si128((const __m128i*)(ptr + off));
+        #define EQ16(c) _mm_cmpeq_epi8(chrs, _mm_set1_epi8(c))
+        uint64_t quote = (unsigned)_mm_movemask_epi8(EQ16('"'));
+        uint64_t backslash = (unsigned)_mm_movemask_epi8(EQ16('\\'));
+        uint64_t op = (unsigned)_mm_movemask_epi8(
+            _mm_or_si128(_mm_or_si128(_mm_or_si128(EQ16('{'), EQ16('}')), _mm_or_si128(EQ16('['), EQ16(']'))),
+                _mm_or_si128(EQ16(':'), EQ16(','))));
+        uint64_t space = (unsigned)_mm_movemask_epi8(
+            _mm_or_si128(_mm_or_si128(EQ16(' '), EQ16('\t')), _mm_or_si128(EQ16('\n'), EQ16('\r'))));
+        #undef EQ16
+        masks.quote |= quote << off;
+        masks.backslash |= backslash << off;
+        masks.op |= op << off;
+        masks.space |= space << off;
+    }
+}
+
+#if defined(__GNUC__)
+#define HAVE_JSON_AVX2
+__attribute__((target("avx2")))
+static void classifyAvx2(const char* ptr, JsonMasks& masks) {
+    masks.quote = masks.backslash = masks.op = masks.space = 0;
+    for (unsigned off = 0; off < 64; off += 32) {
+        __m256i chrs = _mm256_loadu_si256((const __m256i*)(ptr + off));
+        #define EQ32(c) _mm256_cmpeq_epi8(chrs, _mm256_set1_epi8(c))
+        uint64_t quote = (uint32_t)_mm256_movemask_epi8(EQ32('"'));
+        uint64_t backslash = (uint32_t)_mm256_movemask_epi8(EQ32('\\'));
+        uint64_t op = (uint32_t)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_or_si256(_mm256_or_si256(EQ32('{'), EQ32('}')), _mm256_or_si256(EQ32('['), EQ32(']'))),
+                _mm256_or_si256(EQ32(':'), EQ32(','))));
+        uint64_t space = (uint32_t)_mm256_movemask_epi8(
+            _mm256_or_si256(_mm256_or_si256(EQ32(' '), EQ32('\t')), _mm256_or_si256(EQ32('\n'), EQ32('\r'))));
+        #undef EQ32
+        masks.quote |= quote << off;
+        masks.backslash |= backslash << off;
+        masks.op |= op << off;
+        masks.space |= space << off;
+    }
+}
+#endif
+#endif
+
+// Pick best classifier for this cpu.
+static JsonClassify pickClassify() {
+    JsonClassify best = &classifyScalar;
+#ifdef HAVE_JSON_SIMD
+    best = &classifySse2;
+#ifdef HAVE_JSON_AVX2
+    if (__builtin_cpu_supports("avx2")) {
+        best = &classifyAvx2;
+    }
+#endif
+#endif
+    if (getenv("LLWXJSON_SCALAR") != nullptr) {
+        best = &classifyScalar;
+    }
+    return best;
+}
+static JsonClassify jsonClassify() {
+    static const JsonClassify classify = pickClassify();
+    return classify;
+}
+
+static inline unsigned trailingZeros(uint64_t bits) {
+#if defined(_MSC_VER)
+    unsigned long idx;
+    _BitScanForward64(&idx, bits);
+    return (unsigned)idx;
+#else
+    return (unsigned)__builtin_ctzll(bits);
+#endif
+}
+
+// Each bit set from an opening quote up to (not including) its closing quote.
+static inline uint64_t prefixXor(uint64_t bits) {
+    bits ^= bits << 1;
+    bits ^= bits << 2;
+    bits ^= bits << 4;
+    bits ^= bits << 8;
+    bits ^= bits << 16;
+    bits ^= bits << 32;
+    return bits;
+}
+
+// Build structural index of buffer, offsets in ascending order.
+static void jsonScan(const char* data, size_t size, std::vector<uint32_t>& structurals) {
+    JsonClassify classify = jsonClassify();
+    structurals.clear();
+    structurals.reserve(size / 6 + 16);
+
+    uint64_t escapeCarry = 0;   // first byte of next block is escaped
+    uint64_t stringCarry = 0;   // next block starts inside a string, all ones
+    uint64_t sepCarry = 1;      // last byte of previous block was a separator
+    char tail[64];
+
+    for (size_t base = 0; base < size; base += 64) {
+        const char* ptr = data + base;
+        if (size - base < 64) {
+            memset(tail, ' ', sizeof(tail));
+            memcpy(tail, ptr, size - base);
+            ptr = tail;
         }
-        break;
-        case '}':
-            if (fieldValue.empty()) {
-                return END_GROUP;
+        JsonMasks masks;
+        classify(ptr, masks);
+
+        // Escaped characters follow an odd run of backslashes, rare so
+        // walk the backslash bits one at a time.
+        uint64_t escaped = escapeCarry;
+        escapeCarry = 0;
+        uint64_t backslash = masks.backslash & ~escaped;
+        while (backslash != 0) {
+            unsigned bit = trailingZeros(backslash);
+            if (bit == 63) {
+                escapeCarry = 1;
             } else {
-                addJsonValue(jsonFields, fieldName, fieldValue);
-                buffer.backup();
-                return fieldValue;
+                escaped |= uint64_t(2) << bit;
             }
-            break;
-        case '"':
-            getJsonWord(buffer, '"', fieldValue);
-            break;
+            backslash &= ~(uint64_t(3) << bit);
+            backslash &= ~escaped;
+        }
+
+        uint64_t quote = masks.quote & ~escaped;
+        uint64_t inString = prefixXor(quote) ^ stringCarry;
+        stringCarry = (uint64_t)((int64_t)inString >> 63);
+
+        uint64_t op = masks.op & ~inString;
+        uint64_t sep = masks.space | op | quote;
+        uint64_t scalar = ~sep & ~inString & ((sep << 1) | sepCarry);
+        sepCarry = sep >> 63;
+        uint64_t bits = op | quote | scalar;
+        if (size - base < 64) {
+            bits &= (uint64_t(1) << (size - base)) - 1;
+        }
+        while (bits != 0) {
+            structurals.push_back(uint32_t(base + trailingZeros(bits)));
+            bits &= bits - 1;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Stage 2 - build tree from the structural index.
+class JsonBuilder {
+public:
+    JsonBuilder(JsonBuffer& _buffer, const std::vector<uint32_t>& structurals) :
+        buffer(_buffer), arena(_buffer.arena), data(_buffer.data()),
+        pos(structurals.data()), end(structurals.data() + structurals.size()) {
+    }
+
+    void parse(JsonFields& fields) {
+        if (pos == end)
+            return;
+        JsonValue name("");
+        fields.add(name, parseValue());
+        if (pos != end) {
+            invalid();
+        }
+    }
+
+private:
+    char peek() const {
+        return (pos != end) ? data[*pos] : '\0';
+    }
+    void expect(char chr) {
+        if (peek() != chr) {
+            invalid();
+        }
+        pos++;
+    }
+    void invalid() {
+        const char* near = (pos != end) ? data + *pos : buffer.end();
+        assertValid(nullptr, string(near, std::min(size_t(40), size_t(buffer.end() - near))).c_str());
+    }
+    // Values are limited to 4GB, see JsonValue.
+    void checkLength(size_t len) {
+        if (len > UINT32_MAX) {
+            invalid();
+        }
+    }
+
+    JsonBase* parseValue() {
+        switch (peek()) {
+        case '{': {
+            if (JsonBase* raw = skip())
+                return raw;
+            pos++;
+            JsonFields* fields = arena.make<JsonFields>(arena);
+            parseObject(*fields);
+            return fields;
+        }
         case '[': {
-            JsonArray* pJsonArray = new JsonArray();
-            jsonFields[fieldName] = pJsonArray;
-            fieldName.clear();
-            getJsonArray(buffer, *pJsonArray);
+            if (JsonBase* raw = skip())
+                return raw;
+            pos++;
+            JsonArray* array = arena.make<JsonArray>(arena);
+            parseArray(*array);
+            return array;
         }
-        break;
+        case '"': {
+            JsonValue* value = arena.make<JsonValue>();
+            parseString(*value);
+            return value;
+        }
+        case '\0':
+        case '}':
         case ']':
-            // addJsonValue(jsonFields, fieldName, fieldValue);
-            if (jsonFields.size() != 0 || ! fieldValue.empty()) {
-                buffer.backup();
-                return fieldValue;
-            } else {
-                return END_ARRAY;
+        case ':':
+        case ',':
+            invalid();
+            return nullptr;
+        default: {
+            // Bare scalar runs to the next structural, less trailing space.
+            const char* first = data + *pos++;
+            const char* last = (pos != end) ? data + *pos : buffer.end();
+            while (last > first && isspace((unsigned char)last[-1])) {
+                last--;
             }
-            break;
+            checkLength(size_t(last - first));
+            JsonValue* value = arena.make<JsonValue>(first, size_t(last - first));
+            value->scalar = JsonValue::classify(first, value->length());
+            return value;
+        }
         }
     }
 
+    // String starts at opening quote, next structural is its closing quote.
+    void parseString(JsonValue& value) {
+        expect('"');
+        const char* first = data + pos[-1] + 1;
+        expect('"');
+        checkLength(size_t(data + pos[-1] - first));
+        value.set(first, size_t(data + pos[-1] - first));
+        value.scalar = JsonString;
+    }
+
+    void parseObject(JsonFields& fields) {
+        if (peek() == '}') {
+            pos++;
+            return;
+        }
+        for (;;) {
+            JsonValue name;
+            parseString(name);
+            bool keep = buffer.keep != nullptr && mEager == 0 && buffer.keep(name.data(), name.length());
+            JsonKeys::intern(name);
+            expect(':');
+            mEager += keep;
+            JsonBase* value = parseValue();
+            mEager -= keep;
+            fields.add(name, value);
+            if (buffer.index != nullptr) {
+                buffer.index->add(name, value);
+            }
+            if (peek() == ',') {
+                pos++;
+                continue;
+            }
+            expect('}');
+            return;
+        }
+    }
+
+    void parseArray(JsonArray& array) {
+        if (peek() == ']') {
+            pos++;
+            return;
+        }
+        for (;;) {
+            array.push_back(parseValue());
+            if (peek() == ',') {
+                pos++;
+                continue;
+            }
+            expect(']');
+            return;
+        }
+    }
+
+    // Lazy parse. The array or map at pos as JsonRaw if no kept member
+    // name is inside, else nullptr to parse it. Scanning stops at the first
+    // kept name, unbalanced input is left to the parse to report.
+    JsonBase* skip() {
+        if (buffer.keep == nullptr || mEager != 0)
+            return nullptr;
+        unsigned depth = 0;
+        for (const uint32_t* scan = pos; scan != end; scan++) {
+            switch (data[*scan]) {
+            case '{':
+            case '[':
+                depth++;
+                break;
+            case '}':
+            case ']':
+                if (--depth == 0) {
+                    const char* begin = data + *pos;
+                    size_t len = size_t(data + *scan + 1 - begin);
+                    checkLength(len);
+                    pos = scan + 1;
+                    return arena.make<JsonRaw>(begin, len);
+                }
+                break;
+            case '"':
+                // Member name is followed by its closing quote and ':'.
+                if (end - scan > 2 && data[scan[1]] == '"' && data[scan[2]] == ':') {
+                    const char* name = data + *scan + 1;
+                    if (buffer.keep(name, size_t(data + scan[1] - name)))
+                        return nullptr;
+                }
+                scan++;
+                break;
+            }
+        }
+        return nullptr;
+    }
+
+    JsonBuffer& buffer;
+    JsonArena& arena;
+    const char* data;
+    const uint32_t* pos;
+    const uint32_t* end;
+    unsigned mEager = 0;            // inside the value of a kept member
+};
+
+// ---------------------------------------------------------------------------
+// Parse buffer into jsonFields, the top level value is stored under "".
+JsonToken JsonParse(JsonBuffer& buffer, JsonFields& jsonFields) {
+    // Structural offsets are 32 bit.
+    if (buffer.size() > UINT32_MAX) {
+        throw JsonError("Input over 4GB not supported");
+    }
+    std::vector<uint32_t> structurals;
+    jsonScan(buffer.data(), buffer.size(), structurals);
+    JsonBuilder builder(buffer, structurals);
+    builder.parse(jsonFields);
     return END_PARSE;
 }
 
+
+// ---------------------------------------------------------------------------
+// Write pieces, gathered with writev() when the output is stdout.
+static void writePieces(const std::vector<std::pair<const char*, size_t>>& pieces, ostream& out) {
+#ifndef HAVE_WIN
+    if (&out == &cout) {
+        out.flush();
+        std::vector<struct iovec> iov(pieces.size());
+        for (size_t idx = 0; idx < pieces.size(); idx++) {
+            iov[idx].iov_base = (void*)pieces[idx].first;
+            iov[idx].iov_len = pieces[idx].second;
+        }
+        size_t idx = 0;
+        while (idx < iov.size()) {
+            int cnt = (int)std::min(iov.size() - idx, (size_t)IOV_MAX);
+            ssize_t wrote = writev(STDOUT_FILENO, &iov[idx], cnt);
+            if (wrote < 0) {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+            // Skip fully written pieces, trim partially written one.
+            while (idx < iov.size() && (size_t)wrote >= iov[idx].iov_len) {
+                wrote -= iov[idx++].iov_len;
+            }
+            if (idx < iov.size()) {
+                iov[idx].iov_base = (char*)iov[idx].iov_base + wrote;
+                iov[idx].iov_len -= wrote;
+            }
+        }
+        return;
+    }
+#endif
+    for (const auto& piece : pieces) {
+        out.write(piece.first, piece.second);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Shift a packed column, two values per SSE2 add.
+void JsonPacked::add(int64_t offset) {
+    int64_t* ptr = values.data();
+    int64_t* end = ptr + values.size();
+#ifdef HAVE_JSON_SIMD
+    __m128i add = _mm_set1_epi64x(offset);
+    for (; end - ptr >= 4; ptr += 4) {
+        __m128i lo = _mm_loadu_si128((const __m128i*)ptr);
+        __m128i hi = _mm_loadu_si128((const __m128i*)(ptr + 2));
+        _mm_storeu_si128((__m128i*)ptr, _mm_add_epi64(lo, add));
+        _mm_storeu_si128((__m128i*)(ptr + 2), _mm_add_epi64(hi, add));
+    }
+#endif
+    for (; ptr < end; ptr++) {
+        *ptr += offset;
+    }
+}
+
+// ---------------------------------------------------------------------------
+void JsonWriter::write(const JsonBase& node) {
+    switch (node.mJtype) {
+    case JsonBase::Value:
+        writeValue((const JsonValue&)node);
+        break;
+    case JsonBase::Array:
+        writeArray((const JsonArray&)node);
+        break;
+    case JsonBase::Map:
+        writeMap((const JsonMap&)node);
+        break;
+    case JsonBase::Raw:
+        append(((const JsonRaw&)node).data(), ((const JsonRaw&)node).length());
+        break;
+    case JsonBase::None:
+        break;
+    }
+    if (mDepth == 0 && mStyle == JsonPretty) {
+        append('\n');
+    }
+    if (mBuf.size() >= FLUSH_SIZE) {
+        flush();
+    }
+}
+
+void JsonWriter::writeValue(const JsonValue& value) {
+    if (value.tag != 0 && spans != nullptr) {
+        spans->push_back(Span { mFlushed + mBuf.size() + (value.isQuoted() ? 1 : 0), &value });
+    }
+    if (value.isQuoted()) {
+        append('"');
+        append(value.data(), value.length());
+        append('"');
+    } else {
+        append(value.data(), value.length());
+    }
+}
+
+void JsonWriter::writeArray(const JsonArray& array) {
+    append('[');
+    if (array.empty() && mStyle != JsonClassic) {
+        append(']');
+        return;
+    }
+    mDepth++;
+    newline();
+    if (array.packed != nullptr) {
+        writePacked(*array.packed);
+    } else {
+        bool addComma = false;
+        for (const JsonBase* item : array) {
+            if (addComma)
+                separator();
+            addComma = true;
+            write(*item);
+        }
+    }
+    mDepth--;
+    newline();
+    append(']');
+}
+
+// Packed values formatted straight into the buffer.
+void JsonWriter::writePacked(const JsonPacked& packed) {
+    for (size_t idx = 0; idx < packed.values.size(); idx++) {
+        if (idx != 0)
+            separator();
+        if (packed.quoted)
+            append('"');
+        size_t used = mBuf.size();
+        mBuf.resize(used + JsonPacked::TEXT_MAX);
+        mBuf.resize(used + packed.format(packed, packed.values[idx], &mBuf[used]));
+        if (packed.quoted)
+            append('"');
+        if (mBuf.size() >= FLUSH_SIZE) {
+            flush();
+        }
+    }
+}
+
+void JsonWriter::writeMap(const JsonMap& map) {
+    append('{');
+    if (map.empty() && mStyle != JsonClassic) {
+        append('}');
+        return;
+    }
+    mDepth++;
+    newline();
+    bool addComma = false;
+    for (const auto& item : map) {
+        if (addComma)
+            separator();
+        addComma = true;
+        if (! item.first.empty()) {
+            writeValue(item.first);
+            if (mStyle == JsonCompact)
+                append(':');
+            else
+                append(": ", 2);
+        }
+        write(*item.second);
+    }
+    mDepth--;
+    newline();
+    append('}');
+    if (mStyle == JsonClassic)
+        append('\n');
+}
+
+void JsonWriter::flush() {
+    if (mBuf.empty())
+        return;
+    std::vector<std::pair<const char*, size_t>> pieces(1, std::make_pair(mBuf.data(), mBuf.size()));
+    writePieces(pieces, out);
+    mFlushed += mBuf.size();
+    mBuf.clear();
+}
+
+string JsonArray::toString() const {
+    std::ostringstream ostr;
+    JsonWriter(ostr).write(*this);
+    return ostr.str();
+}
+ostream& JsonArray::dump(ostream& out) const {
+    JsonWriter(out).write(*this);
+    return out;
+}
+
+string JsonMap::toString() const {
+    std::ostringstream ostr;
+    JsonWriter(ostr).write(*this);
+    return ostr.str();
+}
+ostream& JsonMap::dump(ostream& out) const {
+    JsonWriter(out).write(*this);
+    return out;
+}
+
 // ---------------------------------------------------------------------------
 // Dump parsed json in json format.
-void JsonDump(const JsonFields& base, ostream& out) {
+void JsonDump(const JsonFields& base, ostream& out, JsonStyle style) {
     // If json parsed, first node can be ignored.
     if (base.at("") != NULL) {
-        base.at("")->dump(out);
+        JsonWriter(out, style).write(*base.at(""));
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Dump original input with only the rewritten spans replaced, keeps the
+// source key order and formatting.
+void JsonSpliceDump(JsonBuffer& buffer, ostream& out) {
+    JsonSpliceDump(buffer.data(), buffer.end(), buffer.splices, out);
+}
+
+// Dump text between begin and end with splices replaced.
+void JsonSpliceDump(const char* begin, const char* end, JsonSplices& splices, ostream& out) {
+    std::sort(splices.begin(), splices.end(), [](const JsonSplice& lhs, const JsonSplice& rhs) {
+        return lhs.orig < rhs.orig;
+    });
+
+    std::vector<std::pair<const char*, size_t>> pieces;
+    pieces.reserve(splices.size() * 2 + 1);
+    const char* pos = begin;
+    for (const JsonSplice& splice : splices) {
+        if (splice.orig < pos || splice.orig + splice.len > end)
+            continue;   // not a span of the input
+        pieces.push_back(std::make_pair(pos, size_t(splice.orig - pos)));
+        pieces.push_back(std::make_pair(splice.value->data(), splice.value->length()));
+        pos = splice.orig + splice.len;
     }
+    pieces.push_back(std::make_pair(pos, size_t(end - pos)));
+    writePieces(pieces, out);
 }
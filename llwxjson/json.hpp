@@ -29,15 +29,30 @@
 
 #include <vector>
 #include <map>
+#include <unordered_map>
 #include <set>
 #include <algorithm>
 #include <regex>
 #include <exception>
+#include <stdexcept>
 #include <assert.h>
+#include <cstring>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
 #include <sstream>
+#include <new>
+#include <type_traits>
 
 using namespace std;
 
+// Invalid json input, thrown by JsonParse.
+class JsonError : public std::runtime_error {
+public:
+    JsonError(const string& msg) : std::runtime_error(msg) {
+    }
+};
+
 typedef std::vector<string> StringList;
 typedef std::map<string, StringList> MapList;
 
@@ -64,11 +79,185 @@ inline const std::string Join(const StringList& list, const char* delim) {
     return buf;
 }
 
+// True if cmd is an abbreviation of name, at least minLen characters long.
+// Command line options of llwxjson and llwxbench.
+inline bool isCmd(const char* cmd, const char* name, size_t minLen) {
+    size_t len = strlen(cmd);
+    return len >= minLen && len <= strlen(name) && strncmp(cmd, name, len) == 0;
+}
+
+
+// ---------------------------------------------------------------------------
+// Per-document bump allocator. Every node and string of one parse lives in a
+// few large blocks which are released together by clear() or the destructor.
+// Strings are kept in their own slab so node memory stays densely aligned.
+class JsonArena {
+public:
+    static const size_t BLOCK_SIZE = 64 * 1024;
+
+    size_t allocCount = 0;      // allocations served since last clear()
+    size_t allocBytes = 0;      // bytes served since last clear()
+    size_t blockCount = 0;      // blocks obtained from the heap (lifetime)
+
+    JsonArena() {
+    }
+    ~JsonArena() {
+        clear();
+        mNodes.release();
+        mStrings.release();
+    }
+    JsonArena(const JsonArena&) = delete;
+    JsonArena& operator=(const JsonArena&) = delete;
+
+    void* alloc(size_t size, size_t align = alignof(std::max_align_t)) {
+        allocCount++;
+        allocBytes += size;
+        return mNodes.alloc(size, align, blockCount);
+    }
+
+    // Uninitialized string slab space for len characters plus a nul.
+    char* strAlloc(size_t len) {
+        allocCount++;
+        allocBytes += len + 1;
+        return (char*)mStrings.alloc(len + 1, 1, blockCount);
+    }
+    // Copy string into the string slab, result is nul terminated.
+    const char* dup(const char* str, size_t len) {
+        char* mem = strAlloc(len);
+        memcpy(mem, str, len);
+        mem[len] = '\0';
+        return mem;
+    }
+
+    // Construct object in arena, destructor (if any) runs at clear().
+    template <class T, class... Args>
+    T* make(Args&&... args) {
+        T* obj = new (alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+        if (! std::is_trivially_destructible<T>::value) {
+            Cleanup* cleanup = new (alloc(sizeof(Cleanup), alignof(Cleanup))) Cleanup;
+            cleanup->destroy = &destroy<T>;
+            cleanup->obj = obj;
+            cleanup->next = mCleanups;
+            mCleanups = cleanup;
+        }
+        return obj;
+    }
+
+    // Destroy all objects, keep standard blocks for the next document.
+    void clear() {
+        while (mCleanups != nullptr) {
+            Cleanup* cleanup = mCleanups;
+            mCleanups = cleanup->next;
+            cleanup->destroy(cleanup->obj);
+        }
+        mNodes.rewind();
+        mStrings.rewind();
+        allocCount = 0;
+        allocBytes = 0;
+    }
+
+private:
+    struct Cleanup {
+        void (*destroy)(void*);
+        void* obj;
+        Cleanup* next;
+    };
+    template <class T>
+    static void destroy(void* obj) {
+        ((T*)obj)->~T();
+    }
+
+    // Chain of heap blocks handed out by bumping a pointer.
+    class Slab {
+    public:
+        void* alloc(size_t size, size_t align, size_t& blockCount) {
+            char* ptr = (char*)(((uintptr_t)mPtr + align - 1) & ~(uintptr_t)(align - 1));
+            if (mPtr == nullptr || ptr + size > mEnd) {
+                if (size + align > BLOCK_SIZE / 4) {
+                    // Oversized request gets its own block, freed by rewind().
+                    char* big = (char*)malloc(size + align);
+                    if (big == nullptr) throw std::bad_alloc();
+                    mLarge.push_back(big);
+                    blockCount++;
+                    return (void*)(((uintptr_t)big + align - 1) & ~(uintptr_t)(align - 1));
+                }
+                nextBlock(blockCount);
+                ptr = (char*)(((uintptr_t)mPtr + align - 1) & ~(uintptr_t)(align - 1));
+            }
+            mPtr = ptr + size;
+            return ptr;
+        }
+        void rewind() {
+            for (char* big : mLarge) {
+                free(big);
+            }
+            mLarge.clear();
+            mIdx = 0;
+            mPtr = mEnd = nullptr;
+        }
+        void release() {
+            rewind();
+            for (char* block : mBlocks) {
+                free(block);
+            }
+            mBlocks.clear();
+        }
+    private:
+        void nextBlock(size_t& blockCount) {
+            if (mIdx == mBlocks.size()) {
+                char* block = (char*)malloc(BLOCK_SIZE);
+                if (block == nullptr) throw std::bad_alloc();
+                mBlocks.push_back(block);
+                blockCount++;
+            }
+            mPtr = mBlocks[mIdx++];
+            mEnd = mPtr + BLOCK_SIZE;
+        }
+
+        std::vector<char*> mBlocks;     // standard blocks, reused after rewind
+        std::vector<char*> mLarge;      // oversized allocations
+        size_t mIdx = 0;                // next standard block to use
+        char* mPtr = nullptr;
+        char* mEnd = nullptr;
+    };
+
+    Slab mNodes;
+    Slab mStrings;
+    Cleanup* mCleanups = nullptr;
+};
+
+// STL allocator which draws from a JsonArena, deallocate is a no-op.
+template <class T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+    JsonArena* arena;
+
+    ArenaAllocator(JsonArena& _arena) : arena(&_arena) {
+    }
+    template <class U>
+    ArenaAllocator(const ArenaAllocator<U>& other) : arena(other.arena) {
+    }
+    T* allocate(size_t cnt) {
+        return (T*)arena->alloc(cnt * sizeof(T), alignof(T));
+    }
+    void deallocate(T*, size_t) {
+    }
+    template <class U>
+    bool operator==(const ArenaAllocator<U>& other) const {
+        return arena == other.arena;
+    }
+    template <class U>
+    bool operator!=(const ArenaAllocator<U>& other) const {
+        return arena != other.arena;
+    }
+};
+
 
 // Base class for all Json objects
 class JsonBase {
 public:
-    enum Jtype { None, Value, Array, Map };
+    enum Jtype : uint8_t { None, Value, Array, Map, Raw };
     Jtype mJtype = None;
     JsonBase(Jtype jtype) {
         mJtype = jtype;
@@ -131,34 +320,208 @@ public:
 };
 
 
-// Simple Value
-class JsonValue : public JsonBase, public string {
+// Scalar kinds, set once by the parser. Numbers keep their text and are
+// decoded on request, output is always the original text.
+enum JsonScalar : uint8_t {
+    JsonBare,       // unquoted text which is not a json literal or number
+    JsonString,     // quoted, view excludes the quotes
+    JsonInt,        // integer up to 18 digits
+    JsonDouble,     // fraction, exponent or too long for JsonInt
+    JsonBool,
+    JsonNull,
+    JsonKey         // quoted member name in the shared key table, see JsonKeys
+};
+
+// Stored in front of the text of every interned member name.
+struct JsonKeyHeader {
+    uint64_t hash;              // JsonValueHash of the text
+    uint32_t id;                // 1 up, in order of first use
+    uint32_t len;
+};
+
+// Simple Value, a view (pointer + length) into the JsonBuffer being parsed.
+// The buffer must outlive the value. Values replaced by assign() get their
+// own storage in the document arena. Packed into 24 bytes, so a value is
+// at most 4GB.
+class JsonValue : public JsonBase {
 public:
-    const char* quote = "\"";
+    JsonScalar scalar = JsonBare;
+    uint8_t tag = 0;            // caller defined, JsonWriter records spans of tagged values
+    uint32_t mLen = 0;
+    const char* mPtr = "";
 
-    bool isQuoted = false;
-    JsonValue() : JsonBase(Value), string() {
+    JsonValue() : JsonBase(Value) {
     }
-    JsonValue(const char* str) : JsonBase(Value), string(str) {
+    JsonValue(const char* str) : JsonBase(Value), mLen((uint32_t)strlen(str)), mPtr(str) {
     }
-    JsonValue(string& str) : JsonBase(Value), string(str) {
+    JsonValue(const char* str, size_t len) : JsonBase(Value), mLen((uint32_t)len), mPtr(str) {
     }
-    JsonValue(const JsonValue& other) : JsonBase(other), string(other), isQuoted(other.isQuoted) {
+    JsonValue(const JsonValue& other) : JsonBase(other), scalar(other.scalar), tag(other.tag), mLen(other.mLen), mPtr(other.mPtr) {
     }
-
-    // Keep isQuoted unchanged.
-    JsonBase& operator=(const string& other) {
-        string::operator=((string&)other);
+    JsonValue& operator=(const JsonValue& other) {
+        mJtype = other.mJtype;
+        scalar = other.scalar;
+        tag = other.tag;
+        mPtr = other.mPtr;
+        mLen = other.mLen;
         return *this;
     }
-    JsonBase& operator=(const char* other) {
-        string::operator=(other);
-        return *this;
+
+    // Kind of unquoted text.
+    static JsonScalar classify(const char* str, size_t len) {
+        if (len == 4 && memcmp(str, "true", 4) == 0)
+            return JsonBool;
+        if (len == 5 && memcmp(str, "false", 5) == 0)
+            return JsonBool;
+        if (len == 4 && memcmp(str, "null", 4) == 0)
+            return JsonNull;
+        const char* ptr = str;
+        const char* end = str + len;
+        if (ptr < end && *ptr == '-')
+            ptr++;
+        const char* digits = ptr;
+        while (ptr < end && (unsigned)(*ptr - '0') <= 9)
+            ptr++;
+        if (ptr == digits)
+            return JsonBare;
+        if (ptr == end)
+            return (ptr - digits <= 18) ? JsonInt : JsonDouble;
+        if (*ptr == '.') {
+            const char* fraction = ++ptr;
+            while (ptr < end && (unsigned)(*ptr - '0') <= 9)
+                ptr++;
+            if (ptr == fraction)
+                return JsonBare;
+        }
+        if (ptr < end && (*ptr == 'e' || *ptr == 'E')) {
+            ptr++;
+            if (ptr < end && (*ptr == '+' || *ptr == '-'))
+                ptr++;
+            const char* exponent = ptr;
+            while (ptr < end && (unsigned)(*ptr - '0') <= 9)
+                ptr++;
+            if (ptr == exponent)
+                return JsonBare;
+        }
+        return (ptr == end) ? JsonDouble : JsonBare;
+    }
+
+    bool isQuoted() const {
+        return scalar == JsonString || scalar == JsonKey;
+    }
+    // Interned member name, see JsonKeys.
+    bool isKey() const {
+        return scalar == JsonKey;
+    }
+    const JsonKeyHeader& keyHeader() const {
+        return ((const JsonKeyHeader*)mPtr)[-1];
+    }
+    // Key id, 0 if not interned.
+    uint32_t keyId() const {
+        return isKey() ? keyHeader().id : 0;
+    }
+    bool isNull() const {
+        return scalar == JsonNull;
+    }
+    // Decoded value, 0 (false) if not that kind.
+    int64_t asInt() const {
+        if (scalar != JsonInt)
+            return 0;
+        const char* ptr = mPtr + (mPtr[0] == '-');
+        int64_t num = 0;
+        for (const char* end = mPtr + mLen; ptr < end; ptr++) {
+            num = num * 10 + (*ptr - '0');
+        }
+        return (mPtr[0] == '-') ? -num : num;
+    }
+    double asDouble() const {
+        if (scalar == JsonInt)
+            return (double)asInt();
+        if (scalar != JsonDouble)
+            return 0;
+        return strtod(str().c_str(), nullptr);   // view is not nul terminated
+    }
+    bool asBool() const {
+        return scalar == JsonBool && mPtr[0] == 't';
+    }
+
+    const char* data() const {
+        return mPtr;
+    }
+    size_t length() const {
+        return mLen;
+    }
+    bool empty() const {
+        return mLen == 0;
+    }
+    string str() const {
+        return string(mPtr, mLen);
+    }
+
+    // Point view at span of parse buffer.
+    void set(const char* ptr, size_t len) {
+        mPtr = ptr;
+        mLen = (uint32_t)len;
+        if (scalar == JsonKey)
+            scalar = JsonString;
+    }
+    // Extend view to include chrPtr, start view if empty.
+    void extend(const char* chrPtr) {
+        if (mLen == 0) {
+            mPtr = chrPtr;
+        }
+        mLen = chrPtr + 1 - mPtr;
+    }
+    // Replace value with a private copy, keep scalar unchanged.
+    void assign(const char* str, size_t len, JsonArena& arena) {
+        mPtr = arena.dup(str, len);
+        mLen = (uint32_t)len;
+        if (scalar == JsonKey)
+            scalar = JsonString;
+    }
+    // Replace value with the decimal text of num, written in the arena.
+    void setInt(int64_t num, JsonArena& arena) {
+        char* text = arena.strAlloc(INT_TEXT_MAX);
+        size_t len = formatInt(num, text);
+        text[len] = '\0';
+        set(text, len);
+        scalar = JsonInt;
+    }
+    // Decimal text of num, buffer needs INT_TEXT_MAX bytes, returns length.
+    static const size_t INT_TEXT_MAX = 20;
+    static size_t formatInt(int64_t num, char* buffer) {
+        char digits[20];
+        char* out = digits + sizeof(digits);
+        uint64_t mag = (num < 0) ? 0 - (uint64_t)num : (uint64_t)num;
+        do {
+            *--out = char('0' + mag % 10);
+            mag /= 10;
+        } while (mag != 0);
+        size_t len = digits + sizeof(digits) - out;
+        char* first = buffer;
+        if (num < 0) {
+            *first++ = '-';
+        }
+        memcpy(first, out, len);
+        return (first - buffer) + len;
+    }
+
+    bool operator==(const char* other) const {
+        return strncmp(mPtr, other, mLen) == 0 && other[mLen] == '\0';
+    }
+    bool operator==(const JsonValue& other) const {
+        if (scalar == JsonKey && other.scalar == JsonKey)
+            return mPtr == other.mPtr;      // one copy per name
+        return mLen == other.mLen && memcmp(mPtr, other.mPtr, mLen) == 0;
+    }
+    bool operator<(const JsonValue& other) const {
+        int cmp = memcmp(mPtr, other.mPtr, std::min(mLen, other.mLen));
+        return (cmp != 0) ? cmp < 0 : mLen < other.mLen;
     }
 
     void clear() {
-        isQuoted = false;
-        string::clear();
+        scalar = JsonBare;
+        mLen = 0;
     }
     ostream& dump(ostream& out) const {
         out << toString();
@@ -182,43 +545,101 @@ public:
     }
 
     string toString() const {
-        if (isQuoted) {
-            return string(quote) + *this + string(quote);
+        if (isQuoted()) {
+            string quoted;
+            quoted.reserve(mLen + 2);
+            quoted += '"';
+            quoted.append(mPtr, mLen);
+            quoted += '"';
+            return quoted;
         }
-        return *this; // ->c_str();
+        return str();
     }
 };
 
-typedef std::vector<JsonBase*> VecJson;
-typedef std::map<JsonValue, JsonBase*> MapJson;
+inline ostream& operator<<(ostream& out, const JsonValue& value) {
+    return out.write(value.data(), value.length());
+}
 
+// FNV-1a hash of a value view, kept in the key table for interned names.
+struct JsonValueHash {
+    size_t operator()(const JsonValue& value) const {
+        if (value.isKey())
+            return (size_t)value.keyHeader().hash;
+        return (size_t)hash(value.data(), value.length());
+    }
+    static uint64_t hash(const char* str, size_t len) {
+        uint64_t hash = 14695981039346656037ULL;
+        for (size_t idx = 0; idx < len; idx++) {
+            hash = (hash ^ (unsigned char)str[idx]) * 1099511628211ULL;
+        }
+        return hash;
+    }
+};
 
-// Array of Json objects
-class JsonArray : public JsonBase, public VecJson {
+// Per-process table of member names. The parser interns every name, so a
+// document holds one shared copy of each name, equal names compare by
+// pointer and hash without rescanning their text. Entries are never
+// removed, names past the limits are left as plain views.
+class JsonKeys {
 public:
-    JsonArray() : JsonBase(Array) {
+    static const uint32_t MAX_KEYS = 65536;
+    static const size_t MAX_LEN = 128;
+
+    // Point name at its shared copy and mark it JsonKey.
+    static void intern(JsonValue& name);
+    // Names interned so far, every id is at most count().
+    static uint32_t count();
+};
+
+// Array items held as one column of int64 values, see JsonArray::packed.
+// The owner converts the items to values and supplies the output format.
+struct JsonPacked {
+    static const size_t TEXT_MAX = 32;      // longest formatted value
+    typedef std::vector<int64_t, ArenaAllocator<int64_t>> Values;
+    // Write text of value to buffer (TEXT_MAX bytes), return length.
+    typedef size_t (*Format)(const JsonPacked& packed, int64_t value, char* buffer);
+
+    Values values;
+    Format format;
+    bool quoted;                // values are written in quotes
+    uint8_t flags = 0;          // format defined
+
+    JsonPacked(JsonArena& arena, Format _format, bool _quoted) :
+        values(ArenaAllocator<int64_t>(arena)), format(_format), quoted(_quoted) {
     }
 
-    string toString() const {
-        std::ostringstream ostr;
-        ostr << "[\n";
-        JsonArray::const_iterator it = begin();
-        bool addComma = false;
-        while (it != end()) {
-            if (addComma)
-                ostr << ",\n";
-            addComma = true;
-            ostr << (*it++)->toString();
-        }
-        ostr << "\n]";
-        return ostr.str();
+    // Add offset to every value.
+    void add(int64_t offset);
+};
+
+// Unparsed array or map, a view of its input bytes which is written out
+// verbatim. Made by lazy parsing, see JsonBuffer::keep.
+class JsonRaw : public JsonValue {
+public:
+    JsonRaw(const char* str, size_t len) : JsonValue(str, len) {
+        mJtype = Raw;
     }
+};
 
-    ostream& dump(ostream& out) const {
-        out << toString();
-        return out;
+typedef std::vector<JsonBase*, ArenaAllocator<JsonBase*>> VecJson;
+typedef std::pair<JsonValue, JsonBase*> JsonMember;
+typedef std::vector<JsonMember, ArenaAllocator<JsonMember>> MapJson;
+
+
+// Array of Json objects. When packed is set the items keep their source
+// text and JsonWriter writes the packed values in their place.
+class JsonArray : public JsonBase, public VecJson {
+public:
+    JsonPacked* packed = nullptr;
+
+    JsonArray(JsonArena& arena) : JsonBase(Array), VecJson(ArenaAllocator<JsonBase*>(arena)) {
     }
 
+    // See JsonWriter
+    string toString() const;
+    ostream& dump(ostream& out) const;
+
     const JsonBase* find(const char* name, const JsonBase*& prevPtr) const  {
         const JsonBase* found = nullptr; // JsonBase::find(name);
         JsonArray::const_iterator it = begin();
@@ -251,43 +672,44 @@ public:
     }
 };
 
-// Map (group) of Json objects
+// Map (group) of Json objects, members kept in document order including
+// duplicate names. Lookups scan small maps and use a hash built on first
+// lookup for large ones, the last member of a duplicated name wins.
 class JsonMap : public JsonBase, public MapJson {
 public:
-    JsonMap() : JsonBase(Map), MapJson() {
-    }
+    static const size_t HASH_MIN = 16;     // members before lookups hash
 
-    string toString() const {
-        ostringstream out;
-        //bool wrapped = false;
-
-        out << "{\n";
-        JsonMap::const_iterator it = begin();
-        bool addComma = false;
-        while (it != end()) {
-            if (addComma)
-                out << ",\n";
-            addComma = true;
+    JsonMap(JsonArena& arena) : JsonBase(Map), MapJson(MapJson::allocator_type(arena)), mArena(arena) {
+    }
 
-            JsonValue name = it->first;
-            JsonBase* pValue = it->second;
-            if (! name.empty()) {
-                // if (!wrapped) {
-                //     wrapped = true;
-                //    out << "{\n";
-                //}
-                out << name.toString() << ": ";
-            }
-            out << pValue->toString();
-            it++;
+    void add(const JsonValue& name, JsonBase* value) {
+        push_back(JsonMember(name, value));
+        if (mHash != nullptr) {
+            (*mHash)[name] = size() - 1;
         }
-        // if (wrapped) {
-        out << "\n}\n";
-        // }
+    }
 
-        return out.str();
+    // Value of member name, nullptr if none.
+    JsonBase* at(const JsonValue& name) const {
+        if (size() >= HASH_MIN) {
+            HashIdx::const_iterator it = hashIdx().find(name);
+            return (it != mHash->end()) ? (*this)[it->second].second : nullptr;
+        }
+        for (size_t idx = size(); idx != 0; idx--) {
+            const JsonMember& member = (*this)[idx - 1];
+            if (member.first == name)
+                return member.second;
+        }
+        return nullptr;
+    }
+    JsonBase* at(const char* name) const {
+        return at(JsonValue(name));
     }
 
+    // See JsonWriter
+    string toString() const;
+    ostream& dump(ostream& out) const;
+
     const JsonBase* find(const char* name, const JsonBase*& prevPtr) const  {
         const JsonBase* found = nullptr;
         JsonMap::const_iterator it = begin();
@@ -304,15 +726,10 @@ public:
         return found;
     }
 
-    ostream& dump(ostream& out) const {
-        out << toString();
-        return out;
-    }
-
     void toMapList(MapList& mapList, StringList& keys) const {
         JsonMap::const_iterator it = begin();
         while (it != end()) {
-            std::string name = it->first;
+            std::string name = it->first.str();
             JsonBase* pValue = it->second;
             keys.push_back(name);
             pValue->toMapList(mapList, keys);
@@ -320,46 +737,158 @@ public:
             it++;
         }
     }
+
+private:
+    typedef std::unordered_map<JsonValue, size_t, JsonValueHash, std::equal_to<JsonValue>,
+        ArenaAllocator<std::pair<const JsonValue, size_t>>> HashIdx;
+
+    const HashIdx& hashIdx() const {
+        if (mHash == nullptr) {
+            mHash = mArena.make<HashIdx>(size() * 2, JsonValueHash(), std::equal_to<JsonValue>(), HashIdx::allocator_type(mArena));
+            for (size_t idx = 0; idx < size(); idx++) {
+                (*mHash)[(*this)[idx].first] = idx;
+            }
+        }
+        return *mHash;
+    }
+
+    JsonArena& mArena;
+    mutable HashIdx* mHash = nullptr;   // name to member index, built on demand
 };
 
 // Alternate name JsonFields for JsonMap
 typedef JsonMap JsonFields;
 
-// String buffer being parsed
-class JsonBuffer : public std::vector<char> {
+// Field name to nodes index, in document order. Filled by JsonParse when
+// JsonBuffer::index is set, or from an existing tree by addTree().
+class JsonIndex {
 public:
-    char keyBuf[10];
+    typedef std::vector<JsonBase*, ArenaAllocator<JsonBase*>> Nodes;
+    typedef std::unordered_map<JsonValue, Nodes, JsonValueHash, std::equal_to<JsonValue>,
+        ArenaAllocator<std::pair<const JsonValue, Nodes>>> MapNodes;
 
-    size_t pos = 0;
-    int seq = 100;
+    JsonIndex(JsonArena& arena) :
+        mArena(arena),
+        mNodes(64, JsonValueHash(), std::equal_to<JsonValue>(), MapNodes::allocator_type(arena)) {
+    }
 
-    void push(const char* cptr) {
-        while (char c = *cptr++) {
-            push_back(c);
+    void add(const JsonValue& name, JsonBase* node) {
+        if (name.empty())
+            return;
+        MapNodes::iterator it = mNodes.find(name);
+        if (it == mNodes.end()) {
+            it = mNodes.emplace(name, Nodes(ArenaAllocator<JsonBase*>(mArena))).first;
         }
-        push_back('\0');
+        it->second.push_back(node);
     }
-    char nextChr() {
-        if (pos < size()) {
-            return at(pos++);
+
+    // Nodes stored under name, nullptr if none.
+    const Nodes* find(const char* name) const {
+        MapNodes::const_iterator it = mNodes.find(JsonValue(name));
+        return (it != mNodes.end()) ? &it->second : nullptr;
+    }
+
+    // First node stored under name, nullptr if none.
+    JsonBase* first(const char* name) const {
+        const Nodes* nodes = find(name);
+        return (nodes != nullptr) ? nodes->front() : nullptr;
+    }
+
+    void addTree(JsonBase* node) {
+        if (node->is(JsonBase::Map)) {
+            for (auto& item : node->asMap()) {
+                add(item.first, item.second);
+                addTree(item.second);
+            }
+        } else if (node->is(JsonBase::Array)) {
+            for (JsonBase* item : node->asArray()) {
+                addTree(item);
+            }
         }
-        return '\0';
     }
-    void backup() {
-        assert(pos > 0);
-        pos--;
+
+    const MapNodes& nodes() const {
+        return mNodes;
+    }
+
+private:
+    JsonArena& mArena;
+    MapNodes mNodes;
+};
+
+// Replacement for a span of the input buffer, used by JsonSpliceDump.
+struct JsonSplice {
+    const char* orig;           // span in input buffer
+    size_t len;
+    const JsonValue* value;     // replacement text
+};
+typedef std::vector<JsonSplice> JsonSplices;
+
+// True if member name is needed, see JsonBuffer::keep.
+typedef bool (*JsonKeepKey)(const char* name, size_t len);
+
+// String buffer being parsed, owns the arena holding the parsed nodes.
+// Regular files are memory mapped and parsed in place, pipes and stdin
+// fall back to read() into private storage.
+class JsonBuffer {
+public:
+    static const size_t MMAP_MIN = 64 * 1024;   // smaller files use read()
+
+    JsonArena arena;
+    JsonIndex* index = nullptr;     // optional field name index, see enableIndex()
+    JsonSplices splices;            // rewritten values, see JsonSpliceDump()
+    // Lazy parse if set. Arrays and maps with no kept member name anywhere
+    // inside become JsonRaw, their bytes are not validated. The value of a
+    // kept member is always parsed in full.
+    JsonKeepKey keep = nullptr;
+
+    JsonBuffer() {
+    }
+    ~JsonBuffer() {
+        unmap();
+    }
+    JsonBuffer(const JsonBuffer&) = delete;
+    JsonBuffer& operator=(const JsonBuffer&) = delete;
+
+    // Load file, "-" reads stdin. Returns false and sets errno on failure.
+    bool load(const char* path);
+    bool load(int fd);
+    bool isMapped() const {
+        return mMap != nullptr;
+    }
+    // Have JsonParse record every field in a name index.
+    JsonIndex& enableIndex() {
+        if (index == nullptr) {
+            index = arena.make<JsonIndex>(arena);
+        }
+        return *index;
     }
 
-    string nextKey() {
-        snprintf(keyBuf, sizeof(keyBuf), "%03d", seq++);
-        return *(new string(keyBuf));
+    const char* data() const {
+        return mData;
+    }
+    size_t size() const {
+        return mSize;
+    }
+    const char* end() const {
+        return mData + mSize;
     }
 
-    const char* ptr(int len = 0) {
-        const char* nowPtr = &at(pos);
-        pos = std::min(pos + len, size());
-        return nowPtr;
+    void push(const char* cptr) {
+        unmap();
+        mStore.insert(mStore.end(), cptr, cptr + strlen(cptr) + 1);
+        mData = mStore.data();
+        mSize = mStore.size();
     }
+
+private:
+    void unmap();
+
+    const char* mData = "";
+    size_t mSize = 0;
+    std::vector<char> mStore;   // read() fallback storage
+    void* mMap = nullptr;
+    size_t mMapLen = 0;
 };
 
 // Json value or parse state change.
@@ -382,9 +911,76 @@ static JsonToken END_ARRAY(JsonToken::EndArray);
 static JsonToken END_GROUP(JsonToken::EndGroup);
 static JsonToken END_PARSE(JsonToken::EndParse);
 
+// Output layout of JsonWriter.
+enum JsonStyle {
+    JsonClassic,    // newline after every item, same as toString()
+    JsonCompact,    // no whitespace
+    JsonPretty      // one item per line, indented PRETTY_INDENT per level
+};
+
+// Serialize a tree into one growable buffer, written out in large chunks
+// with no per node temporaries.
+class JsonWriter {
+public:
+    static const size_t FLUSH_SIZE = 256 * 1024;
+    static const unsigned PRETTY_INDENT = 2;
+
+    // Output offset of a tagged value, excluding quotes.
+    struct Span {
+        size_t offset;
+        const JsonValue* value;
+    };
+    std::vector<Span>* spans = nullptr;     // tagged values written, if set
+
+    JsonWriter(ostream& _out, JsonStyle _style = JsonClassic) : out(_out), mStyle(_style) {
+        mBuf.reserve(FLUSH_SIZE);
+    }
+    ~JsonWriter() {
+        flush();
+    }
+    JsonWriter(const JsonWriter&) = delete;
+    JsonWriter& operator=(const JsonWriter&) = delete;
+
+    void write(const JsonBase& node);
+    void flush();
+
+private:
+    void append(const char* str, size_t len) {
+        mBuf.append(str, len);
+    }
+    void append(char chr) {
+        mBuf.push_back(chr);
+    }
+    void writeValue(const JsonValue& value);
+    void writeArray(const JsonArray& array);
+    void writeMap(const JsonMap& map);
+    void writePacked(const JsonPacked& packed);
+
+    // Line break and indent between items, none when compact.
+    void newline() {
+        if (mStyle != JsonCompact) {
+            mBuf.push_back('\n');
+            if (mStyle == JsonPretty)
+                mBuf.append(mDepth * PRETTY_INDENT, ' ');
+        }
+    }
+    void separator() {
+        mBuf.push_back(',');
+        newline();
+    }
+
+    ostream& out;
+    JsonStyle mStyle = JsonClassic;
+    unsigned mDepth = 0;        // open arrays and maps
+    string mBuf;
+    size_t mFlushed = 0;        // bytes written before mBuf
+};
+
 // Forward definition
 JsonToken JsonParse(JsonBuffer& buffer, JsonFields& jsonFields);
-void JsonDump(const JsonFields& base, ostream& out);
+void JsonDump(const JsonFields& base, ostream& out, JsonStyle style = JsonClassic);
+void JsonSpliceDump(JsonBuffer& buffer, ostream& out);
+void JsonSpliceDump(const char* begin, const char* end, JsonSplices& splices, ostream& out);
 
 #endif /* json_h */
 
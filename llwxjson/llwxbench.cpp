@@ -0,0 +1,355 @@
+//-------------------------------------------------------------------------------------------------
+//  llwxbench.cpp      Created by dennis.lang on 17-Oct-2026
+//  Copyright © 2026 Dennis Lang. All rights reserved.
+//-------------------------------------------------------------------------------------------------
+// This file is part of llwxjson project.
+//
+// Benchmark parse, relative time rewrite and dump. Runs each phase several
+// times per file and prints one json line per file and phase, so results
+// can be saved and compared across commits:
+//    make bench > bench-`git rev-parse --short HEAD`.jsonl
+//
+// Input is any json files (ex: test1.zip extracted) plus optional synthetic
+// forecast shaped documents from a seeded generator, same seed same bytes.
+//
+
+#if defined(_WIN32) || defined(_WIN64)
+#define HAVE_WIN
+#define NOMINMAX
+#define _CRT_SECURE_NO_WARNINGS   // define before all includes
+#endif
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+
+// Project files
+#include "json.hpp"
+#include "wxupdate.cpp"
+
+#ifndef GIT_REV
+#define GIT_REV "unknown"
+#endif
+
+using namespace std;
+
+typedef std::chrono::steady_clock Clock;
+
+struct BenchOptions {
+    unsigned repeat = 5;
+    uint64_t seed = 1;
+    std::vector<uint64_t> synthSizes;
+    string tmpDir = "/tmp";
+    Epoch_t now = 1718000000;       // fixed now, rewritten text is the same every run
+};
+
+// Discard output, only count bytes.
+class NullBuf : public std::streambuf {
+public:
+    size_t count = 0;
+protected:
+    std::streamsize xsputn(const char*, std::streamsize len) override {
+        count += (size_t)len;
+        return len;
+    }
+    int overflow(int chr) override {
+        count++;
+        return chr;
+    }
+};
+
+// Timings of one phase over all repeats.
+struct Phase {
+    const char* name;
+    std::vector<uint64_t> nanos;
+    size_t outBytes = 0;
+    bool ok = true;
+    Phase(const char* _name) : name(_name) {
+    }
+};
+
+// ---------------------------------------------------------------------------
+static uint64_t elapsedNs(Clock::time_point started) {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - started).count();
+}
+
+// ---------------------------------------------------------------------------
+static size_t countNodes(const JsonBase* node) {
+    size_t count = 1;
+    if (const JsonArray* array = node->asArrayPtr()) {
+        for (const JsonBase* item : *array) {
+            count += countNodes(item);
+        }
+    } else if (const JsonMap* map = node->asMapPtr()) {
+        for (const JsonMember& member : *map) {
+            count += countNodes(member.second);
+        }
+    }
+    return count;
+}
+
+// ---------------------------------------------------------------------------
+// Json string escaped for output, file names only need quote and backslash.
+static string quoted(const string& str) {
+    string out = "\"";
+    for (char chr : str) {
+        if (chr == '"' || chr == '\\')
+            out += '\\';
+        out += chr;
+    }
+    return out + "\"";
+}
+
+// ---------------------------------------------------------------------------
+static void report(const string& name, size_t bytes, size_t nodes, Phase& phase) {
+    std::sort(phase.nanos.begin(), phase.nanos.end());
+    uint64_t minNs = std::max(phase.nanos.front(), (uint64_t)1);
+    uint64_t medianNs = phase.nanos[phase.nanos.size() / 2];
+    char line[512];
+    snprintf(line, sizeof(line),
+        "{\"rev\":\"%s\",\"file\":%s,\"phase\":\"%s\",\"ok\":%s,\"bytes\":%zu,\"nodes\":%zu,\"outBytes\":%zu,"
+        "\"repeat\":%zu,\"minNs\":%llu,\"medianNs\":%llu,\"MBps\":%.1f,\"nsPerNode\":%.2f}\n",
+        GIT_REV, quoted(name).c_str(), phase.name, phase.ok ? "true" : "false", bytes, nodes, phase.outBytes,
+        phase.nanos.size(), (unsigned long long)minNs, (unsigned long long)medianNs,
+        bytes * 1000.0 / minNs, nodes != 0 ? (double)minNs / nodes : 0.0);
+    cout << line << std::flush;
+}
+
+// ---------------------------------------------------------------------------
+// Time parse, dump and relative of one file, false if it does not parse.
+// relative is only the time rewrite, its output is relativeDump.
+// lazy is a lazy parse plus relative, compare with parse + relative.
+static bool benchFile(const string& path, const string& name, const BenchOptions& options) {
+    Phase parse("parse"), dump("dump"), relative("relative"), relativeDump("relativeDump");
+    Phase lazy("lazy"), lazyDump("lazyDump");
+    size_t bytes = 0, nodes = 0;
+    for (unsigned rep = 0; rep < options.repeat; rep++) {
+        JsonBuffer buffer;
+        JsonFields fields(buffer.arena);
+        if (! buffer.load(path.c_str())) {
+            cerr << strerror(errno) << ", Unable to open " << path << endl;
+            return false;
+        }
+        buffer.enableIndex();
+        bytes = buffer.size();
+
+        Clock::time_point started = Clock::now();
+        try {
+            JsonParse(buffer, fields);
+        } catch (const exception& ex) {
+            cerr << ex.what() << ", Error in file:" << path << endl;
+            return false;
+        }
+        parse.nanos.push_back(elapsedNs(started));
+        if (fields.at("") == nullptr)
+            return false;
+        nodes = countNodes(fields.at(""));
+
+        NullBuf dumpBuf;
+        ostream dumpOut(&dumpBuf);
+        started = Clock::now();
+        JsonDump(fields, dumpOut);
+        dump.nanos.push_back(elapsedNs(started));
+        dump.outBytes = dumpBuf.count;
+
+        // Rewrites the tree, so last.
+        NullBuf relativeBuf;
+        ostream relativeOut(&relativeBuf);
+        WxStats relativeStats;
+        relative.ok = JsonWxRelative(buffer, fields, relativeOut, false, false, JsonClassic, options.now, &relativeStats);
+        relative.nanos.push_back(relativeStats.phases[WxStats::Update].wallNs);
+        relativeDump.nanos.push_back(relativeStats.phases[WxStats::Output].wallNs);
+        relativeDump.ok = relative.ok;
+        relativeDump.outBytes = relativeBuf.count;
+
+        JsonBuffer lazyBuffer;
+        JsonFields lazyFields(lazyBuffer.arena);
+        lazyBuffer.load(path.c_str());
+        lazyBuffer.enableIndex();
+        lazyBuffer.keep = &wxKeepKey;
+        NullBuf lazyBuf;
+        ostream lazyOut(&lazyBuf);
+        WxStats lazyStats;
+        started = Clock::now();
+        JsonParse(lazyBuffer, lazyFields);
+        uint64_t lazyParseNs = elapsedNs(started);
+        lazy.ok = JsonWxRelative(lazyBuffer, lazyFields, lazyOut, false, false, JsonClassic, options.now, &lazyStats);
+        lazy.nanos.push_back(lazyParseNs + lazyStats.phases[WxStats::Update].wallNs);
+        lazyDump.nanos.push_back(lazyStats.phases[WxStats::Output].wallNs);
+        lazyDump.ok = lazy.ok;
+        lazyDump.outBytes = lazyBuf.count;
+    }
+    report(name, bytes, nodes, parse);
+    report(name, bytes, nodes, dump);
+    report(name, bytes, nodes, relative);
+    report(name, bytes, nodes, relativeDump);
+    report(name, bytes, nodes, lazy);
+    report(name, bytes, nodes, lazyDump);
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// xorshift64*, same seed same document on every platform.
+class BenchRandom {
+public:
+    BenchRandom(uint64_t seed) : state(seed != 0 ? seed : 1) {
+    }
+    uint64_t next() {
+        state ^= state >> 12;
+        state ^= state << 25;
+        state ^= state >> 27;
+        return state * 2685821657736338717ULL;
+    }
+    unsigned below(unsigned limit) {
+        return (unsigned)(next() >> 33) % limit;
+    }
+private:
+    uint64_t state;
+};
+
+// ---------------------------------------------------------------------------
+// Write forecast shaped document of about size bytes. Repeats blocks of a
+// 15 day hourly v3 forecast (parallel arrays) and v2 style hourly objects.
+static bool writeSynth(const string& path, uint64_t size, uint64_t seed) {
+    static const char* PHRASES[] = { "Sunny", "Partly Cloudy", "Mostly Cloudy", "Cloudy", "Showers",
+        "Thunderstorms", "Light Rain", "Snow Showers", "Fog", "Clear" };
+    static const int HOURS = 360;
+    BenchRandom random(seed);
+    std::ofstream out(path.c_str(), std::ios::binary | std::ios::trunc);
+    if (! out.good()) {
+        cerr << strerror(errno) << ", Unable to create " << path << endl;
+        return false;
+    }
+
+    Epoch_t start = 1718000000;     // 10-Jun-2024 06:13:20 UTC
+    const int offset = -4 * 3600;
+    out << "{\n \"metadata\": {\"language\": \"en-US\", \"version\": \"1\", \"validTimeUtc\": " << start
+        << ", \"expireTimeGmt\": " << start + 900 << ", \"seed\": " << seed << "},\n \"blocks\": [\n";
+    char iso[ISO8601_MAX];          // local time, first 19 chars used
+    WxDays days;
+    uint64_t written = (uint64_t)out.tellp();
+    for (int block = 0; written < size; block++) {
+        Epoch_t blockStart = start + (Epoch_t)block * HOURS * 3600;
+        std::ostringstream text;
+        text << (block != 0 ? ",\n" : "") << "  {\n   \"validTimeUtc\": [";
+        for (int hour = 0; hour < HOURS; hour++) {
+            text << (hour != 0 ? "," : "") << blockStart + hour * 3600;
+        }
+        text << "],\n   \"validTimeLocal\": [";
+        for (int hour = 0; hour < HOURS; hour++) {
+            toISO8601(iso, 0, blockStart + hour * 3600 + offset, days);
+            text << (hour != 0 ? "," : "") << '"' << string(iso, 19) << "-0400\"";
+        }
+        text << "],\n   \"dayOfWeek\": [";
+        for (int hour = 0; hour < HOURS; hour++) {
+            text << (hour != 0 ? "," : "") << '"' << DOW[days.at(blockStart + hour * 3600 + offset).wday] << '"';
+        }
+        text << "],\n   \"temperature\": [";
+        for (int hour = 0; hour < HOURS; hour++) {
+            text << (hour != 0 ? "," : "") << 40 + (int)random.below(50);
+        }
+        text << "],\n   \"wxPhraseLong\": [";
+        for (int hour = 0; hour < HOURS; hour++) {
+            text << (hour != 0 ? "," : "") << '"' << PHRASES[random.below(10)] << '"';
+        }
+        text << "],\n   \"forecasts\": [\n";
+        for (int hour = 0; hour < HOURS; hour += 6) {
+            Epoch_t valid = blockStart + hour * 3600;
+            toISO8601(iso, 0, valid + offset, days);
+            text << (hour != 0 ? ",\n" : "") << "    {\"class\": \"fod_long_range_hourly\", \"fcst_valid\": " << valid
+                << ", \"fcst_valid_local\": \"" << string(iso, 19) << "-0400\""
+                << ", \"dow\": \"" << DOW[days.at(valid + offset).wday] << '"'
+                << ", \"temp\": " << 40 + (int)random.below(50)
+                << ", \"pop\": " << random.below(101)
+                << ", \"rh\": " << random.below(101)
+                << ", \"wspd\": " << random.below(30)
+                << ", \"icon_code\": " << random.below(48)
+                << ", \"wx_phrase\": \"" << PHRASES[random.below(10)] << "\"}";
+        }
+        text << "\n   ]\n  }";
+        const string& textStr = text.str();
+        out.write(textStr.data(), textStr.length());
+        written += textStr.length();
+    }
+    out << "\n ]\n}\n";
+    out.flush();
+    if (! out.good()) {
+        cerr << strerror(errno) << ", Unable to write " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Size with optional K, M or G suffix, 0 if invalid.
+static uint64_t parseSize(const char* str) {
+    char* end;
+    uint64_t size = strtoull(str, &end, 10);
+    switch (toupper(*end)) {
+    case 'K': return size << 10;
+    case 'M': return size << 20;
+    case 'G': return size << 30;
+    case '\0': return size;
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+int main(int argc, char* argv[]) {
+    BenchOptions options;
+    std::vector<string> files;
+
+    for (int argn = 1; argn < argc; argn++) {
+        const char* cmd = argv[argn] + 1;
+        bool hasValue = argn + 1 < argc;
+        if (*argv[argn] != '-') {
+            files.push_back(argv[argn]);
+        } else if (isCmd(cmd, "repeat", 1) && hasValue) {
+            options.repeat = std::max(1u, (unsigned)strtoul(argv[++argn], nullptr, 10));
+        } else if (isCmd(cmd, "seed", 2) && hasValue) {
+            options.seed = strtoull(argv[++argn], nullptr, 10);
+        } else if (isCmd(cmd, "synth", 2) && hasValue) {
+            std::istringstream sizes(argv[++argn]);
+            string size;
+            while (std::getline(sizes, size, ',')) {
+                if (parseSize(size.c_str()) == 0) {
+                    cerr << "Invalid synth size " << size << endl;
+                    return -1;
+                }
+                options.synthSizes.push_back(parseSize(size.c_str()));
+            }
+        } else if (isCmd(cmd, "tmp", 2) && hasValue) {
+            options.tmpDir = argv[++argn];
+        } else {
+            cerr << "\n" << argv[0] << "  Dennis Lang " __DATE__ << "\n"
+                << "\nDes: Benchmark llwxjson parse, relative and dump, one json line per file and phase\n"
+                    "Use: llwxbench [options] [file.json ...]\n"
+                    "\n"
+                    " Options:\n"
+                    "   -repeat <n>     ; Runs per phase, min and median reported, default 5\n"
+                    "   -seed <n>       ; Synthetic document seed, default 1\n"
+                    "   -synth <sizes>  ; Synthetic documents, ex 1M,64M,1G\n"
+                    "   -tmp <dir>      ; Directory for synthetic documents, default /tmp\n"
+                    "\n"
+                    " Output fields: rev file phase ok bytes nodes outBytes repeat minNs medianNs MBps nsPerNode\n"
+                    "\n";
+            return 1;
+        }
+    }
+
+    int failed = 0;
+    for (const string& file : files) {
+        size_t slash = file.find_last_of("/\\");
+        if (! benchFile(file, (slash == string::npos) ? file : file.substr(slash + 1), options))
+            failed++;
+    }
+    for (uint64_t size : options.synthSizes) {
+        string name = "synth-" + std::to_string(size) + "-" + std::to_string(options.seed) + ".json";
+        string path = options.tmpDir + "/llwxbench-" + name;
+        if (! writeSynth(path, size, options.seed) || ! benchFile(path, name, options))
+            failed++;
+        remove(path.c_str());
+    }
+    return failed == 0 ? 0 : -1;
+}
@@ -20,6 +20,7 @@
 
 #include <iostream>
 #include <fstream>
+#include <thread>
 #include <sys/stat.h>
 
 
@@ -29,6 +30,12 @@
 // Project files
 #include "json.hpp"
 #include "wxupdate.cpp"
+#include "wxstream.cpp"
+#include "wxserver.cpp"
+#include "wxtemplate.cpp"
+#include "wxbatch.cpp"
+#include "wxcache.cpp"
+#include "wxdeflate.cpp"
 
 using namespace std;
 
@@ -38,62 +45,289 @@ public:
     bool verbose;
     bool addHttpdPrefix;
     bool test;
-    Options() : dumpOnly(false), verbose(false), addHttpdPrefix(true), test(false) {}
+    bool stream;
+    bool splice;
+    bool compile;
+    bool render;
+    bool lazy;                  // only parse subtrees holding time fields
+    const char* serverPath;     // Unix socket, null if not a server
+    const char* batchSrc;       // directory or list file, null if not a batch
+    const char* outDir;         // batch output, required with batch
+    const char* cacheDir;       // rendered output cache, null if disabled
+    const char* statsPath;      // per document stats line, "-" is stderr, null if disabled
+    const char* encoding;       // http body Content-Encoding, null is uncompressed
+    uint64_t cacheBytes;
+    unsigned threads;
+    unsigned quantize;          // round now down to a multiple of seconds, 0 is exact (WX_CACHE_QUANTIZE with cache)
+    JsonStyle style;            // tree output layout
+    Epoch_t now;                // zero for current time
+    Options() : dumpOnly(false), verbose(false), addHttpdPrefix(true), test(false), stream(false), splice(false),
+        compile(false), render(false), lazy(false), serverPath(nullptr),
+        batchSrc(nullptr), outDir(nullptr), cacheDir(nullptr), statsPath(nullptr), encoding(nullptr), cacheBytes(uint64_t(64) << 20),
+        threads(std::thread::hardware_concurrency()), quantize(0), style(JsonClassic), now(0) {}
+
+    // Settings for CGI runs, which have no command line.
+    void getEnv() {
+        const char* value;
+        if ((value = getenv("LLWXJSON_CACHE")) != nullptr && *value != '\0')
+            cacheDir = value;
+        if ((value = getenv("LLWXJSON_CACHE_MB")) != nullptr && *value != '\0')
+            cacheBytes = strtoull(value, nullptr, 10) << 20;
+        if ((value = getenv("LLWXJSON_QUANTIZE")) != nullptr && *value != '\0')
+            quantize = (unsigned)strtoul(value, nullptr, 10);
+        if ((value = getenv("LLWXJSON_STATS")) != nullptr && *value != '\0')
+            statsPath = value;
+        if ((value = getenv("LLWXJSON_LAZY")) != nullptr && *value != '\0')
+            lazy = strcmp(value, "0") != 0;
+        encoding = acceptEncoding(getenv("HTTP_ACCEPT_ENCODING"));
+    }
 };
 
 // ---------------------------------------------------------------------------
-// Open, read and parse file.
-bool JsonParseFile(const string& filepath, const Options& options) {
-    ifstream        in;
-    ofstream        out;
-    struct stat     filestat;
-    JsonFields fields;
+// Full path of file named by query string, "site=" prefix is optional.
+// Parameters after '&' set per request options:
+//    site=data/wx.json&format=compact      format is compact, pretty or classic
+static string queryPath(const char* query, Options& options) {
+    const char* end = strchr(query, '&');
+    string path(query, (end != nullptr) ? end - query : strlen(query));
+    size_t equal = path.find('=');
+    if (equal != string::npos) {
+        path.erase(0, equal + 1);
+    }
+
+    while (end != nullptr) {
+        const char* param = end + 1;
+        end = strchr(param, '&');
+        string name(param, (end != nullptr) ? end - param : strlen(param));
+        string value;
+        equal = name.find('=');
+        if (equal != string::npos) {
+            value = name.substr(equal + 1);
+            name.erase(equal);
+        }
+        if (name == "format") {
+            if (value == "compact")
+                options.style = JsonCompact;
+            else if (value == "pretty")
+                options.style = JsonPretty;
+            else if (value == "classic")
+                options.style = JsonClassic;
+        }
+    }
+
+    char tmpBuf[256];
+    string fullpath = getcwd(tmpBuf, sizeof(tmpBuf));
+    fullpath += "/";
+    fullpath += path;
+    return fullpath;
+}
+
+// ---------------------------------------------------------------------------
+// Append line to stats log, or stderr for "-". One write per line so
+// concurrent processes do not interleave.
+static void writeStats(const char* statsPath, const string& line) {
+    if (strcmp(statsPath, "-") == 0) {
+        cerr << line;
+        return;
+    }
+    FILE* log = fopen(statsPath, "a");
+    if (log == nullptr) {
+        cerr << strerror(errno) << ", Unable to open stats log " << statsPath << endl;
+        return;
+    }
+    fwrite(line.data(), 1, line.length(), log);
+    fclose(log);
+}
+
+// ---------------------------------------------------------------------------
+// Http header, the body after it is compressed if out compresses.
+static void httpPrefix(ostream& out) {
+#ifdef HAVE_ZLIB
+    // Body depends on Accept-Encoding, shared caches must key on it.
+    if (WxDeflateBuf* deflate = dynamic_cast<WxDeflateBuf*>(out.rdbuf())) {
+        out << "Content-type: text/json\nContent-Encoding: " << deflate->name() << "\nVary: Accept-Encoding\n\n";
+        deflate->start();
+        return;
+    }
+    out << "Content-type: text/json\nVary: Accept-Encoding\n\n";
+#else
+    out << "Content-type: text/json\n\n";
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// Open, read and parse file, response written to out. Phases are timed
+// into stats if set.
+static bool parseFile(const string& filepath, const Options& options, ostream& out, WxStats* stats) {
+    JsonBuffer      buffer;     // Owns all parsed nodes, must outlive fields.
+    JsonFields      fields(buffer.arena);
 
     if (options.verbose) {
         std::cerr << "Parsing file:" << filepath << std::endl;
     }
 
-    try {
-        if (stat(filepath.c_str(), &filestat) != 0)
-            return false;
+    // Header is only written once the body is known to succeed.
+    WxPrefix prefix = options.addHttpdPrefix ? &httpPrefix : nullptr;
+
+    // Output is the same for every request in a now bucket.
+    Epoch_t now = options.now;
+    bool cacheable = options.cacheDir != nullptr && ! options.compile && ! options.dumpOnly && ! options.test;
+    // An exact now changes every second and would miss the cache on nearly every request.
+    unsigned quantize = (options.quantize == 0 && cacheable) ? WX_CACHE_QUANTIZE : options.quantize;
+    if (quantize != 0) {
+        if (now == 0) {
+            now = std::time(0);
+        }
+        now -= now % quantize;
+    }
 
-        in.open(filepath);
-        if (in.good()) {
-            JsonBuffer buffer;
-            buffer.resize(filestat.st_size + 1);
-            streamsize inCnt = in.read(buffer.data(), buffer.size()).gcount();
-            assert(inCnt < buffer.size());
-            in.close();
-            buffer.push_back('\0');
-            JsonParse(buffer, fields);
+    if (cacheable) {
+        static const char* STYLE_NAMES[] = { "tree", "compact", "pretty" };
+        string mode = options.render ? "render" : options.stream ? "stream" : options.splice ? "splice" : STYLE_NAMES[options.style];
+        if (options.lazy && ! options.splice) {
+            mode += "-lazy";        // unparsed subtrees keep their input layout
+        }
+        string key = WxCache::key(filepath, now, mode);
+        if (! key.empty()) {
+            WxCache cache(options.cacheDir, options.cacheBytes, options.verbose);
+            if (stats != nullptr) {
+                WxPhase phase(stats, WxStats::Output);
+                stats->cacheHit = cache.send(key, out, prefix);
+                if (stats->cacheHit)
+                    return ! out.bad();
+            } else if (cache.send(key, out, prefix)) {
+                return ! out.bad();
+            }
+
+            Options bodyOptions = options;
+            bodyOptions.cacheDir = nullptr;
+            bodyOptions.addHttpdPrefix = false;
+            bodyOptions.quantize = 0;
+            bodyOptions.now = now;
+            std::ostringstream body;
+            bool ok = parseFile(filepath, bodyOptions, body, stats);
+            if (! ok)
+                return false;       // no header, the server reports an error
+            const string& bodyStr = body.str();
+            cache.store(key, bodyStr);
+            if (prefix != nullptr) {
+                prefix(out);
+            }
+            out.write(bodyStr.data(), bodyStr.length());
+            return true;
+        }
+    }
+
+    if (options.render && ! options.compile && ! options.dumpOnly && ! options.test) {
+        WxTemplate tpl;
+        bool loaded;
+        {
+            WxPhase phase(stats, WxStats::Load);
+            loaded = tpl.load(filepath, options.verbose);
+        }
+        if (loaded) {
+            if (prefix != nullptr) {
+                prefix(out);
+            }
+            WxPhase phase(stats, WxStats::Output);
+            tpl.render(out, now);
+            return true;
+        }
+        // Missing or stale template, use source.
+    }
+
+    if (options.stream && ! options.compile && ! options.dumpOnly && ! options.test) {
+        WxPhase phase(stats, WxStats::Output);     // read, rewrite and write in one pass
+        return JsonWxStream(filepath, out, options.verbose, now, prefix);
+    }
+
+    try {
+        bool loaded;
+        {
+            WxPhase phase(stats, WxStats::Load);
+            loaded = buffer.load(filepath.c_str());
+        }
+        if (loaded) {
+            if (! options.dumpOnly && ! options.test) {
+                buffer.enableIndex();
+                if (options.lazy) {
+                    buffer.keep = &wxKeepKey;
+                }
+            }
+            {
+                WxPhase phase(stats, WxStats::Parse);
+                JsonParse(buffer, fields);
+            }
+            if (stats != nullptr) {
+                stats->bytes = buffer.size();
+                if (fields.at("") != nullptr) {
+                    stats->countNodes(fields.at(""));
+                }
+            }
+            if (options.verbose) {
+                cerr << "Parsed " << buffer.size() << (buffer.isMapped() ? " mapped" : "") << " bytes"
+                    << ", arena allocations=" << buffer.arena.allocCount
+                    << " bytes=" << buffer.arena.allocBytes
+                    << " blocks=" << buffer.arena.blockCount << endl;
+            }
         } else {
-            if (options.verbose) cerr << strerror(errno) << ", Unable to open " << filepath << endl;
+            cerr << strerror(errno) << ", Unable to open " << filepath << endl;
             return false;
         }
-    } catch (exception ex) {
-        if (options.verbose) cerr << ex.what() << ", Error in file:" << filepath << endl;
+    } catch (const exception& ex) {
+        cerr << ex.what() << ", Error in file:" << filepath << endl;
         return false;
     }
 
-    if (options.addHttpdPrefix) {
-        // Prefix for HTTPD server
-        cout << "Content-type: text/json\n\n";
+    if (options.compile) {
+        return JsonWxCompile(buffer, fields, filepath, options.splice, options.style, options.verbose);
     }
 
+    bool ok = true;
+    if (options.test || options.dumpOnly) {
+        if (prefix != nullptr) {
+            prefix(out);
+        }
+    }
     if (options.test) {
         JsonTest();
     } else if (options.dumpOnly) {
-        JsonDump(fields, cout);
+        WxPhase phase(stats, WxStats::Output);
+        JsonDump(fields, out, options.style);
     } else {
-        return JsonWxRelative(fields, cout, options.verbose);
+        ok = JsonWxRelative(buffer, fields, out, options.verbose, options.splice, options.style, now, stats, prefix);
     }
+    if (stats != nullptr) {
+        stats->setArena(buffer.arena);
+    }
+    return ok;
+}
 
-    return true;
+// ---------------------------------------------------------------------------
+bool JsonParseFile(const string& filepath, const Options& options, ostream& out) {
+    WxStats stats;
+    WxStats* statsPtr = (options.statsPath != nullptr) ? &stats : nullptr;
+    bool ok;
+#ifdef HAVE_ZLIB
+    if (options.addHttpdPrefix && options.encoding != nullptr) {
+        // Body compressed as it is written, after httpPrefix().
+        WxDeflateBuf deflate(out, options.encoding);
+        ostream deflateOut(&deflate);
+        ok = deflate.ready() ? parseFile(filepath, options, deflateOut, statsPtr) : parseFile(filepath, options, out, statsPtr);
+        deflate.finish();
+    } else
+#endif
+    ok = parseFile(filepath, options, out, statsPtr);
+    if (statsPtr != nullptr) {
+        writeStats(options.statsPath, stats.toJson(filepath, ok));
+    }
+    return ok;
 }
 
 // ---------------------------------------------------------------------------
 int main(int argc, char* argv[]) {
     Options options;
+    options.getEnv();
     char* cgiCmdStr = nullptr;
 
     if (argc == 1) {
@@ -107,15 +341,39 @@ int main(int argc, char* argv[]) {
             cerr << "\n" << argv[0] << "  Dennis Lang " VERSION " " __DATE__ << "\n"
                 << "\nDes: Make weather times relative to now\n"
                     "Use: llwxjson [options] file\n"
+                    "     (file - reads stdin)\n"
                     "\n"
                     " Options:\n"
+                    "   -batch <dir|list> ; Convert every *.json in dir, or each file named in list\n"
+                    "   -cache <dir>  ; Reuse relative output saved in dir, shared by all processes\n"
+                    "                 ;   now is quantized, default 60 sec unless -quantize is set\n"
+                    "   -cacheSize <MB> ; Cache directory limit, least recently used removed, default 64\n"
+                    "   -out <dir>    ; Batch output directory, required, not a source directory\n"
+                    "   -compact      ; Output json without whitespace\n"
+                    "   -compile      ; Save output template as file.wxt, use with -render\n"
                     "   -dump         ; Only dump parsed json\n"
+                    "   -lazy         ; Only parse subtrees with time fields, others are copied as is\n"
                     "   -noHttpPrefix ; Disable http content-type output\n"
+                    "   -pretty       ; Output json indented, one item per line\n"
+                    "   -quantize <sec> ; Round now down to a multiple of sec, ex 60, default 60 with -cache\n"
+                    "   -render       ; Output from template file.wxt if not stale\n"
+                    "   -splice       ; Output input bytes with only the time values replaced\n"
+                    "   -stats        ; Json line per document to stderr: phase times, nodes, allocations, matches, peak RSS\n"
+                    "   -statsLog <file> ; Append stats lines to file instead of stderr\n"
+                    "   -stream       ; Stream input to output, rewrite times inline (no tree)\n"
+                    "   -rules <file> ; Add time field rules, lines of: <kind> <fieldName>\n"
+                    "                 ;   kind is one of epoch, epochDay, iso, isoDay, dow\n"
+                    "   -server <socket> ; Serve requests on Unix socket, one query line per connection\n"
+                    "   -threads <n>  ; Server or batch worker threads, default is cpu count\n"
                     "   -verbose    \n"
                     "   -test       \n"
                     "\n"
                     " or pass filename using environment variable QUERY_STRING \n"
                     "   setenv QUERY_STRING /path/wxjson.json \n"
+                    "   setenv QUERY_STRING site=path/wxjson.json&format=compact   (or pretty)\n"
+                    "   optional LLWXJSON_CACHE=<dir> LLWXJSON_CACHE_MB=<MB> LLWXJSON_QUANTIZE=<sec>\n"
+                    "            LLWXJSON_STATS=<log file or - for stderr> LLWXJSON_LAZY=1\n"
+                    "   body is gzip or deflate compressed if HTTP_ACCEPT_ENCODING allows (HAVE_ZLIB builds, not Windows)\n"
                     "\n";
             return 1;
         }
@@ -124,9 +382,113 @@ int main(int argc, char* argv[]) {
     bool doParseCmds = true;
     string endCmds = "--";
     for (int argn = 1; argn < argc; argn++) {
-        if (*argv[argn] == '-' && doParseCmds) {
+        if (*argv[argn] == '-' && argv[argn][1] != '\0' && doParseCmds) {
             string argStr(argv[argn]);
-            switch (argStr[(unsigned)1]) {
+            const char* cmd = argv[argn] + 1;
+            if (isCmd(cmd, "batch", 1)) {
+                if (argn + 1 < argc) {
+                    options.batchSrc = argv[++argn];
+                } else {
+                    std::cerr << "Missing batch directory or list" << std::endl;
+                }
+                continue;
+            } else if (isCmd(cmd, "cacheSize", 6)) {
+                if (argn + 1 < argc) {
+                    options.cacheBytes = strtoull(argv[++argn], nullptr, 10) << 20;
+                } else {
+                    std::cerr << "Missing cache size" << std::endl;
+                }
+                continue;
+            } else if (isCmd(cmd, "cache", 2)) {
+                if (argn + 1 < argc) {
+                    options.cacheDir = argv[++argn];
+                } else {
+                    std::cerr << "Missing cache directory" << std::endl;
+                }
+                continue;
+            } else if (isCmd(cmd, "compact", 5)) {
+                options.style = JsonCompact;
+                continue;
+            } else if (isCmd(cmd, "compile", 1)) {
+                options.compile = true;
+                continue;
+            } else if (isCmd(cmd, "dump", 1)) {
+                options.dumpOnly = true;
+                continue;
+            } else if (isCmd(cmd, "lazy", 1)) {
+                options.lazy = true;
+                continue;
+            } else if (isCmd(cmd, "noHttpPrefix", 1)) {
+                options.addHttpdPrefix = false;
+                continue;
+            } else if (isCmd(cmd, "out", 1)) {
+                if (argn + 1 < argc) {
+                    options.outDir = argv[++argn];
+                } else {
+                    std::cerr << "Missing output directory" << std::endl;
+                }
+                continue;
+            } else if (isCmd(cmd, "pretty", 1)) {
+                options.style = JsonPretty;
+                continue;
+            } else if (isCmd(cmd, "quantize", 1)) {
+                if (argn + 1 < argc) {
+                    options.quantize = (unsigned)strtoul(argv[++argn], nullptr, 10);
+                } else {
+                    std::cerr << "Missing quantize seconds" << std::endl;
+                }
+                continue;
+            } else if (isCmd(cmd, "render", 3)) {
+                options.render = true;
+                continue;
+            } else if (isCmd(cmd, "rules", 1)) {
+                if (argn + 1 < argc) {
+                    if (! wxRules().load(argv[++argn], true))
+                        return -1;
+                } else {
+                    std::cerr << "Missing rules file" << std::endl;
+                }
+                continue;
+            } else if (isCmd(cmd, "server", 2)) {
+                if (argn + 1 < argc) {
+                    options.serverPath = argv[++argn];
+                } else {
+                    std::cerr << "Missing server socket path" << std::endl;
+                }
+                continue;
+            } else if (isCmd(cmd, "splice", 2)) {
+                options.splice = true;
+                continue;
+            } else if (isCmd(cmd, "statsLog", 6)) {
+                if (argn + 1 < argc) {
+                    options.statsPath = argv[++argn];
+                } else {
+                    std::cerr << "Missing stats log file" << std::endl;
+                }
+                continue;
+            } else if (isCmd(cmd, "stats", 3)) {
+                options.statsPath = "-";
+                continue;
+            } else if (isCmd(cmd, "stream", 2)) {
+                options.stream = true;
+                continue;
+            } else if (isCmd(cmd, "test", 1)) {
+                options.test = true;
+                continue;
+            } else if (isCmd(cmd, "threads", 2)) {
+                if (argn + 1 < argc) {
+                    options.threads = (unsigned)strtoul(argv[++argn], nullptr, 10);
+                } else {
+                    std::cerr << "Missing thread count" << std::endl;
+                }
+                continue;
+            } else if (isCmd(cmd, "verbose", 1)) {
+                options.verbose = true;
+                continue;
+            }
+
+            // Original options matched on first letter only, ex -noHttpdPrefix.
+            switch (*cmd) {
             case 'd':   // dump
                 options.dumpOnly = true;
                 continue;
@@ -147,17 +509,37 @@ int main(int argc, char* argv[]) {
                 std::cerr << "Unknown command " << argStr << std::endl;
             }
         } else {
-            return JsonParseFile(argv[argn], options) ? 0 : -1;
+            return JsonParseFile(argv[argn], options, cout) ? 0 : -1;
         }
     }
 
+    if (options.batchSrc != nullptr) {
+        if (options.outDir == nullptr) {
+            std::cerr << "Missing -out directory for batch" << std::endl;
+            return -1;
+        }
+        // One now for the whole batch, outputs are files so no http prefix.
+        options.now = std::time(0);
+        options.addHttpdPrefix = false;
+        wxRules();      // build before workers start
+        return JsonWxBatch(options.batchSrc, options.outDir, options.threads, [&options](const string& path, ostream& out) {
+            return JsonParseFile(path, options, out);
+        }, options.verbose) ? 0 : -1;
+    }
+
+    if (options.serverPath != nullptr) {
+        options.encoding = nullptr;     // request headers are not forwarded
+        wxRules();      // build before workers start
+        return JsonWxServe(options.serverPath, options.threads, [&options](const string& query, ostream& out) {
+            Options request = options;
+            string path = queryPath(query.c_str(), request);
+            return JsonParseFile(path, request, out);
+        }, options.verbose) ? 0 : -1;
+    }
+
     if (cgiCmdStr != nullptr && strlen(cgiCmdStr) != 0) {
-        char tmpBuf[256];
-        getcwd(tmpBuf, sizeof(tmpBuf));
-        string fullpath = tmpBuf;
-        fullpath += "/";
-        fullpath += strchr(cgiCmdStr, '=') + 1; // skip over "site=" prefix
-        return JsonParseFile(fullpath.c_str(), options) ? 0 : -1;
+        string path = queryPath(cgiCmdStr, options);
+        return JsonParseFile(path, options, cout) ? 0 : -1;
     }
 
     return 0;
@@ -0,0 +1,268 @@
+//-------------------------------------------------------------------------------------------------
+//  wxbatch.cpp      Created by dennis.lang on 17-Oct-2026
+//  Copyright © 2026 Dennis Lang. All rights reserved.
+//-------------------------------------------------------------------------------------------------
+// This file is part of llwxjson project.
+//
+// Batch mode, convert many files in one process. Files are spread over a
+// work stealing thread pool, each output is written to a temp file and
+// renamed so readers only ever see complete files. Outputs keep the source
+// file name, so outDir may not be a source directory and names must be
+// unique, checked before any file is converted.
+//
+
+#ifndef wxbatch_cpp
+#define wxbatch_cpp
+
+// Project files
+#include "json.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <thread>
+#include <sys/stat.h>
+
+#ifdef HAVE_WIN
+#include <process.h>
+#include <stdlib.h>
+#else
+#include <dirent.h>
+#include <unistd.h>
+#endif
+#ifndef S_ISDIR
+#define S_ISDIR(mode) (((mode) & S_IFMT) == S_IFDIR)
+#endif
+
+// Write output for file to out, false if conversion failed.
+typedef std::function<bool(const string& path, ostream& out)> WxFileHandler;
+
+class WxBatch {
+public:
+    WxBatch(WxFileHandler _handler, bool _verbose) : handler(_handler), verbose(_verbose) {
+    }
+
+    // Files to convert, src is a directory (all *.json) or a list file.
+    bool addFiles(const string& src) {
+        struct stat srcStat;
+        if (stat(src.c_str(), &srcStat) != 0) {
+            cerr << strerror(errno) << ", Unable to open " << src << endl;
+            return false;
+        }
+        if (S_ISDIR(srcStat.st_mode)) {
+#ifdef HAVE_WIN
+            cerr << "Batch directory not supported on Windows, use a list file " << src << endl;
+            return false;
+#else
+            DIR* dir = opendir(src.c_str());
+            if (dir == nullptr) {
+                cerr << strerror(errno) << ", Unable to read directory " << src << endl;
+                return false;
+            }
+            size_t first = mFiles.size();
+            while (struct dirent* entry = readdir(dir)) {
+                size_t len = strlen(entry->d_name);
+                if (len > 5 && strcmp(entry->d_name + len - 5, ".json") == 0) {
+                    mFiles.push_back(src + "/" + entry->d_name);
+                }
+            }
+            closedir(dir);
+            std::sort(mFiles.begin() + first, mFiles.end());
+#endif
+        } else {
+            std::ifstream list(src.c_str());
+            string line;
+            while (std::getline(list, line)) {
+                line.erase(std::min(line.find_first_of("\r#"), line.length()));
+                if (! line.empty()) {
+                    mFiles.push_back(line);
+                }
+            }
+        }
+        return true;
+    }
+
+    // Convert every file into outDir, true if all succeeded.
+    bool run(const string& outDir, unsigned threads) {
+        if (! checkOutputs(outDir))
+            return false;
+
+        typedef std::chrono::steady_clock Clock;
+        Clock::time_point started = Clock::now();
+        threads = std::max(1u, std::min(threads, (unsigned)std::max(mFiles.size(), size_t(1))));
+
+        // Deal files round robin, owners take from the front, thieves the back.
+        mQueues.clear();
+        for (unsigned idx = 0; idx < threads; idx++) {
+            mQueues.emplace_back(new Queue());
+        }
+        for (size_t idx = 0; idx < mFiles.size(); idx++) {
+            mQueues[idx % threads]->files.push_back(idx);
+        }
+
+        mFailed = 0;
+        std::vector<std::thread> workers;
+        for (unsigned idx = 0; idx < threads; idx++) {
+            workers.push_back(std::thread(&WxBatch::work, this, idx, std::cref(outDir)));
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+
+        if (verbose) {
+            long msec = (long)std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - started).count();
+            cerr << "Batch files=" << mFiles.size() << " failed=" << mFailed
+                << " threads=" << threads << " msec=" << msec << endl;
+        }
+        return mFailed == 0;
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> files;
+    };
+
+    static string baseName(const string& path) {
+        size_t slash = path.find_last_of("/\\");
+        return (slash == string::npos) ? path : path.substr(slash + 1);
+    }
+    static string dirName(const string& path) {
+        size_t slash = path.find_last_of("/\\");
+        return (slash == string::npos) ? "." : (slash == 0) ? "/" : path.substr(0, slash);
+    }
+
+    // True if both paths name the same directory.
+    static bool sameDir(const string& dir1, const string& dir2) {
+#ifdef HAVE_WIN
+        char full1[_MAX_PATH], full2[_MAX_PATH];
+        return _fullpath(full1, dir1.c_str(), sizeof(full1)) != nullptr
+            && _fullpath(full2, dir2.c_str(), sizeof(full2)) != nullptr
+            && _stricmp(full1, full2) == 0;
+#else
+        struct stat stat1, stat2;
+        return stat(dir1.c_str(), &stat1) == 0 && stat(dir2.c_str(), &stat2) == 0
+            && stat1.st_dev == stat2.st_dev && stat1.st_ino == stat2.st_ino;
+#endif
+    }
+
+    // False if an output would replace a source or another output.
+    bool checkOutputs(const string& outDir) {
+        struct stat outStat;
+        if (stat(outDir.c_str(), &outStat) != 0 || ! S_ISDIR(outStat.st_mode)) {
+            cerr << "Output directory not found " << outDir << endl;
+            return false;
+        }
+        bool ok = true;
+        std::map<string, const string*> names;
+        std::set<string> dirs;
+        for (const string& path : mFiles) {
+            string dir = dirName(path);
+            if (dirs.insert(dir).second && sameDir(dir, outDir)) {
+                cerr << "Output directory " << outDir << " holds source files of " << dir << endl;
+                ok = false;
+            }
+            auto inserted = names.insert(std::make_pair(baseName(path), &path));
+            if (! inserted.second) {
+                cerr << "Same output name for " << *inserted.first->second << " and " << path << endl;
+                ok = false;
+            }
+        }
+        return ok;
+    }
+
+    // Next file for worker, own queue first then steal from the others.
+    bool next(unsigned self, size_t& fileIdx) {
+        for (size_t cnt = 0; cnt < mQueues.size(); cnt++) {
+            Queue& queue = *mQueues[(self + cnt) % mQueues.size()];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (! queue.files.empty()) {
+                if (cnt == 0) {
+                    fileIdx = queue.files.front();
+                    queue.files.pop_front();
+                } else {
+                    fileIdx = queue.files.back();
+                    queue.files.pop_back();
+                }
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(unsigned self, const string& outDir) {
+        size_t fileIdx;
+        while (next(self, fileIdx)) {
+            const string& path = mFiles[fileIdx];
+            string error;
+            if (! convert(path, outDir, self, error)) {
+                mFailed++;
+                std::ostringstream msg;
+                msg << "Failed " << path << (error.empty() ? "" : ", ") << error << "\n";
+                cerr << msg.str();
+            }
+        }
+    }
+
+    bool convert(const string& path, const string& outDir, unsigned self, string& error) {
+        string outPath = outDir + "/" + baseName(path);
+        // Overlapping batch runs may share outDir.
+        string tmpPath = outPath + ".tmp" + std::to_string(getpid()) + "." + std::to_string(self);
+
+        bool ok;
+        {
+            std::ofstream out(tmpPath.c_str(), std::ios::binary | std::ios::trunc);
+            if (! out.good()) {
+                error = string(strerror(errno)) + ", Unable to create " + tmpPath;
+                return false;
+            }
+            try {
+                ok = handler(path, out);
+            } catch (const exception& ex) {
+                error = ex.what();
+                ok = false;
+            }
+            out.flush();
+            if (ok && ! out.good()) {
+                error = string(strerror(errno)) + ", Unable to write " + tmpPath;
+                ok = false;
+            }
+        }
+        if (ok) {
+#ifdef HAVE_WIN
+            remove(outPath.c_str());
+#endif
+            if (rename(tmpPath.c_str(), outPath.c_str()) != 0) {
+                error = string(strerror(errno)) + ", Unable to rename " + tmpPath;
+                ok = false;
+            }
+        }
+        if (! ok) {
+            remove(tmpPath.c_str());
+        }
+        return ok;
+    }
+
+    WxFileHandler handler;
+    bool verbose;
+    std::vector<string> mFiles;
+    std::vector<std::unique_ptr<Queue>> mQueues;
+    std::atomic<unsigned> mFailed;
+};
+
+// ---------------------------------------------------------------------------
+// Convert all files of src (directory or list file) into outDir.
+static bool JsonWxBatch(const string& src, const string& outDir, unsigned threads, WxFileHandler handler, bool verbose) {
+    WxBatch batch(handler, verbose);
+    return batch.addFiles(src) && batch.run(outDir, threads);
+}
+
+#endif
@@ -0,0 +1,284 @@
+//-------------------------------------------------------------------------------------------------
+//  wxcache.cpp      Created by dennis.lang on 17-Oct-2026
+//  Copyright © 2026 Dennis Lang. All rights reserved.
+//-------------------------------------------------------------------------------------------------
+// This file is part of llwxjson project.
+//
+// Rendered output cache shared by every process using the same directory.
+// Relative output only depends on the source file and now, so with now
+// quantized (-quantize, default WX_CACHE_QUANTIZE) requests in the same
+// time bucket share one entry.
+// A hit is copied straight to the output (sendfile), nothing is parsed.
+//
+// Cache entry <dir>/<key hash>.out:
+//    WxCacheHeader
+//    key[keyLen]        full key, guards against hash collisions
+//    output body, no http prefix
+//
+// Entries are written to a temp file and renamed. A hit touches the entry
+// mtime, the oldest entries are removed when the directory exceeds its limit.
+// Stores add to a running byte total in <dir>/cache.size (locked), so the
+// directory is only scanned when the total crosses the limit.
+//
+
+#ifndef wxcache_cpp
+#define wxcache_cpp
+
+// Project files
+#include "json.hpp"
+#include "wxupdate.cpp"
+#include "wxtemplate.cpp"      // modifyTime()
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <fstream>
+#include <sys/stat.h>
+
+#ifndef HAVE_WIN
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/time.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#endif
+
+static const char WX_CACHE_MAGIC[8] = { 'L', 'L', 'W', 'X', 'O', 'U', 'T', '1' };
+static const char* WX_CACHE_EXT = ".out";
+static const char* WX_CACHE_SIZE = "cache.size";    // running byte total
+static const unsigned WX_CACHE_QUANTIZE = 60;  // default now bucket (sec) when caching
+
+struct WxCacheHeader {
+    char magic[8];
+    uint64_t keyLen;
+    uint64_t bodyLen;
+};
+
+class WxCache {
+public:
+    WxCache(const string& _dir, uint64_t _maxBytes, bool _verbose) : dir(_dir), maxBytes(_maxBytes), verbose(_verbose) {
+    }
+
+    // Key of output for srcPath at bucket now, empty if source is missing.
+    // mode separates output formats of the same source.
+    static string key(const string& srcPath, Epoch_t now, const string& mode) {
+        struct stat srcStat;
+        if (stat(srcPath.c_str(), &srcStat) != 0)
+            return string();
+        std::ostringstream key;
+        key << srcPath << '\n' << modifyTime(srcStat) << ' ' << (uint64_t)srcStat.st_size
+            << ' ' << now << ' ' << mode << ' ' << wxRules().digest();
+        return key.str();
+    }
+
+#ifdef HAVE_WIN
+    bool send(const string&, ostream&, WxPrefix = nullptr) {
+        return false;
+    }
+    void store(const string&, const string&) {
+    }
+#else
+    // Copy cached body for key to out after prefix, false on a miss and
+    // nothing is written. A failed copy is still a hit, out is marked bad.
+    bool send(const string& key, ostream& out, WxPrefix prefix = nullptr) {
+        string path = entryPath(key);
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            if (verbose) cerr << "Cache miss " << path << endl;
+            return false;
+        }
+        WxCacheHeader header;
+        bool hit = readAll(fd, (char*)&header, sizeof(header))
+            && memcmp(header.magic, WX_CACHE_MAGIC, sizeof(header.magic)) == 0
+            && header.keyLen == key.length();
+        if (hit) {
+            string entryKey(key.length(), '\0');
+            hit = readAll(fd, &entryKey[0], entryKey.length()) && entryKey == key;
+        }
+        struct stat entryStat;
+        if (hit && (fstat(fd, &entryStat) != 0
+            || (uint64_t)entryStat.st_size != sizeof(header) + header.keyLen + header.bodyLen)) {
+            hit = false;
+        }
+        if (hit) {
+            if (prefix != nullptr) {
+                prefix(out);
+            }
+            if (! copyBody(fd, (off_t)(sizeof(header) + header.keyLen), header.bodyLen, out)) {
+                out.setstate(std::ios::badbit);
+            }
+            futimens(fd, nullptr);      // most recently used
+        }
+        close(fd);
+        if (verbose) cerr << (hit ? "Cache hit " : "Cache miss ") << path << endl;
+        return hit;
+    }
+
+    // Save body for key, then trim the directory to its size limit.
+    void store(const string& key, const string& body) {
+        string path = entryPath(key);
+        static std::atomic<unsigned> sequence(0);      // server threads share the pid
+        string tmpPath = path + ".tmp" + std::to_string(getpid()) + "." + std::to_string(++sequence);
+        WxCacheHeader header;
+        memcpy(header.magic, WX_CACHE_MAGIC, sizeof(header.magic));
+        header.keyLen = key.length();
+        header.bodyLen = body.length();
+        {
+            std::ofstream entry(tmpPath.c_str(), std::ios::binary | std::ios::trunc);
+            entry.write((const char*)&header, sizeof(header));
+            entry.write(key.data(), key.length());
+            entry.write(body.data(), body.length());
+            if (! entry.good()) {
+                if (verbose) cerr << strerror(errno) << ", Unable to write " << tmpPath << endl;
+                remove(tmpPath.c_str());
+                return;
+            }
+        }
+        struct stat prevStat;
+        int64_t prevSize = (stat(path.c_str(), &prevStat) == 0) ? (int64_t)prevStat.st_size : 0;
+        if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+            if (verbose) cerr << strerror(errno) << ", Unable to rename " << tmpPath << endl;
+            remove(tmpPath.c_str());
+            return;
+        }
+        int64_t entrySize = (int64_t)(sizeof(header) + key.length() + body.length());
+        if (updateSize(entrySize - prevSize, false) > maxBytes) {
+            evict();
+        }
+    }
+#endif
+
+private:
+    string entryPath(const string& key) const {
+        uint64_t hash = 14695981039346656037ULL;
+        for (char chr : key) {
+            hash = (hash ^ (unsigned char)chr) * 1099511628211ULL;
+        }
+        char name[24];
+        snprintf(name, sizeof(name), "%016llx", (unsigned long long)hash);
+        return dir + "/" + name + WX_CACHE_EXT;
+    }
+
+#ifndef HAVE_WIN
+    static bool readAll(int fd, char* data, size_t len) {
+        while (len != 0) {
+            ssize_t got = read(fd, data, len);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                return false;
+            data += got;
+            len -= got;
+        }
+        return true;
+    }
+
+    // Copy len bytes at offset, with sendfile when the output is stdout.
+    static bool copyBody(int fd, off_t offset, uint64_t len, ostream& out) {
+#ifdef __linux__
+        if (&out == &cout) {
+            out.flush();
+            while (len != 0) {
+                ssize_t sent = sendfile(STDOUT_FILENO, fd, &offset, (size_t)std::min(len, (uint64_t)1 << 30));
+                if (sent < 0 && errno == EINTR)
+                    continue;
+                if (sent <= 0)
+                    return false;
+                len -= sent;
+            }
+            return true;
+        }
+#endif
+        if (lseek(fd, offset, SEEK_SET) != offset)
+            return false;
+        char chunk[64 * 1024];
+        while (len != 0) {
+            size_t want = (size_t)std::min(len, (uint64_t)sizeof(chunk));
+            if (! readAll(fd, chunk, want))
+                return false;
+            out.write(chunk, want);
+            len -= want;
+        }
+        return true;
+    }
+
+    // Add delta to the running total, or set it when exact, returns the
+    // new total. Without a size file every store scans the directory.
+    uint64_t updateSize(int64_t delta, bool exact) {
+        string path = dir + "/" + WX_CACHE_SIZE;
+        int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0)
+            return UINT64_MAX;
+        uint64_t total = 0;
+        if (flock(fd, LOCK_EX) == 0) {
+            if (! exact && pread(fd, &total, sizeof(total), 0) != (ssize_t)sizeof(total)) {
+                total = 0;
+            }
+            total = (delta < 0 && (uint64_t)-delta > total) ? 0 : total + delta;
+            if (pwrite(fd, &total, sizeof(total), 0) != (ssize_t)sizeof(total)) {
+                total = UINT64_MAX;
+            }
+            flock(fd, LOCK_UN);
+        } else {
+            total = UINT64_MAX;
+        }
+        close(fd);
+        return total;
+    }
+
+    // Remove least recently used entries until the directory fits in maxBytes.
+    void evict() {
+        struct Entry {
+            string path;
+            int64_t mtime;
+            uint64_t size;
+        };
+        DIR* dirPtr = opendir(dir.c_str());
+        if (dirPtr == nullptr)
+            return;
+        std::vector<Entry> entries;
+        uint64_t total = 0;
+        size_t extLen = strlen(WX_CACHE_EXT);
+        while (struct dirent* dirEntry = readdir(dirPtr)) {
+            size_t len = strlen(dirEntry->d_name);
+            if (len <= extLen || strcmp(dirEntry->d_name + len - extLen, WX_CACHE_EXT) != 0)
+                continue;
+            string path = dir + "/" + dirEntry->d_name;
+            struct stat entryStat;
+            if (stat(path.c_str(), &entryStat) == 0) {
+                entries.push_back(Entry { path, modifyTime(entryStat), (uint64_t)entryStat.st_size });
+                total += entryStat.st_size;
+            }
+        }
+        closedir(dirPtr);
+        if (total <= maxBytes) {
+            updateSize((int64_t)total, true);
+            return;
+        }
+
+        // Trim to 90% so every store does not evict.
+        std::sort(entries.begin(), entries.end(), [](const Entry& lhs, const Entry& rhs) {
+            return lhs.mtime < rhs.mtime;
+        });
+        uint64_t target = maxBytes / 10 * 9;
+        for (const Entry& entry : entries) {
+            if (total <= target)
+                break;
+            if (remove(entry.path.c_str()) == 0) {
+                total -= entry.size;
+                if (verbose) cerr << "Cache evict " << entry.path << endl;
+            }
+        }
+        updateSize((int64_t)total, true);
+    }
+#endif
+
+    string dir;
+    uint64_t maxBytes;
+    bool verbose;
+};
+
+#endif
@@ -0,0 +1,183 @@
+//-------------------------------------------------------------------------------------------------
+//  wxdeflate.cpp      Created by dennis.lang on 17-Oct-2026
+//  Copyright © 2026 Dennis Lang. All rights reserved.
+//-------------------------------------------------------------------------------------------------
+// This file is part of llwxjson project.
+//
+// gzip / deflate http response compression, picked from the CGI
+// HTTP_ACCEPT_ENCODING header. Output passes through unchanged until the
+// http header is written, then the body is compressed as it is written,
+// the document is never held in memory. Needs zlib, build with HAVE_ZLIB.
+//
+
+#ifndef wxdeflate_cpp
+#define wxdeflate_cpp
+
+// Project files
+#include "json.hpp"
+
+#include <cstdlib>
+#include <iostream>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+// ---------------------------------------------------------------------------
+// Content-Encoding to use for an Accept-Encoding header, null for none.
+//   ex: "gzip, deflate, br"   "deflate;q=1.0, gzip;q=0.5"   "*"
+static const char* acceptEncoding(const char* header) {
+#ifdef HAVE_ZLIB
+    const char* best = nullptr;
+    double bestQ = 0;
+    std::istringstream codings(header != nullptr ? header : "");
+    string coding;
+    while (std::getline(codings, coding, ',')) {
+        double q = 1;
+        size_t semi = coding.find(';');
+        if (semi != string::npos) {
+            size_t qPos = coding.find("q=", semi);
+            if (qPos != string::npos)
+                q = strtod(coding.c_str() + qPos + 2, nullptr);
+            coding.erase(semi);
+        }
+        coding.erase(0, coding.find_first_not_of(" \t"));
+        coding.erase(coding.find_last_not_of(" \t") + 1);
+        const char* name = nullptr;
+        if (strcasecmp(coding.c_str(), "gzip") == 0 || coding == "*")
+            name = "gzip";
+        else if (strcasecmp(coding.c_str(), "deflate") == 0)
+            name = "deflate";
+        // gzip wins ties, listed order otherwise.
+        if (name != nullptr && q > 0 && (q > bestQ || (q == bestQ && strcmp(name, "gzip") == 0))) {
+            best = name;
+            bestQ = q;
+        }
+    }
+    return best;
+#else
+    (void)header;
+    return nullptr;
+#endif
+}
+
+#ifdef HAVE_ZLIB
+// ---------------------------------------------------------------------------
+// Stream buffer which copies to out, compressed after start().
+class WxDeflateBuf : public std::streambuf {
+public:
+    static const size_t CHUNK_SIZE = 64 * 1024;
+
+    // encoding is "gzip" or "deflate" (zlib format, as http defines it).
+    WxDeflateBuf(ostream& _out, const char* _encoding) : out(_out), encoding(_encoding) {
+        memset(&mStream, 0, sizeof(mStream));
+        int windowBits = (strcmp(encoding, "gzip") == 0) ? 15 + 16 : 15;
+        mReady = deflateInit2(&mStream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, windowBits, 8, Z_DEFAULT_STRATEGY) == Z_OK;
+    }
+    ~WxDeflateBuf() {
+        finish();
+        if (mReady) {
+            deflateEnd(&mStream);
+        }
+    }
+    WxDeflateBuf(const WxDeflateBuf&) = delete;
+    WxDeflateBuf& operator=(const WxDeflateBuf&) = delete;
+
+    const char* name() const {
+        return encoding;
+    }
+    // False if zlib could not be initialized.
+    bool ready() const {
+        return mReady;
+    }
+
+    // Compress everything written from now on, once only.
+    void start() {
+        if (! mReady || mStarted || mFinished)
+            return;
+        mStarted = true;
+        mIn.resize(CHUNK_SIZE);
+        mOut.resize(CHUNK_SIZE);
+        setp(mIn.data(), mIn.data() + mIn.size());
+    }
+
+    // Compress pending input and write the stream trailer.
+    void finish() {
+        if (! mStarted)
+            return;
+        compress(Z_FINISH);
+        mStarted = false;
+        mFinished = true;
+        setp(nullptr, nullptr);
+        out.flush();
+    }
+
+protected:
+    int overflow(int chr) override {
+        if (! mStarted) {
+            return (chr == EOF || out.put((char)chr)) ? 0 : EOF;
+        }
+        compress(Z_NO_FLUSH);
+        if (chr != EOF) {
+            *pptr() = (char)chr;
+            pbump(1);
+        }
+        return out.good() ? 0 : EOF;
+    }
+
+    std::streamsize xsputn(const char* str, std::streamsize len) override {
+        if (! mStarted) {
+            out.write(str, len);
+            return out.good() ? len : 0;
+        }
+        std::streamsize left = len;
+        while (left != 0) {
+            std::streamsize room = epptr() - pptr();
+            if (room == 0) {
+                compress(Z_NO_FLUSH);
+                room = epptr() - pptr();
+            }
+            std::streamsize cnt = std::min(room, left);
+            memcpy(pptr(), str, (size_t)cnt);
+            pbump((int)cnt);
+            str += cnt;
+            left -= cnt;
+        }
+        return out.good() ? len : 0;
+    }
+
+    // Hand buffered input to zlib. No Z_SYNC_FLUSH, that costs ratio.
+    int sync() override {
+        if (mStarted) {
+            compress(Z_NO_FLUSH);
+        }
+        out.flush();
+        return out.good() ? 0 : -1;
+    }
+
+private:
+    // Deflate the put area and write any output.
+    void compress(int flush) {
+        mStream.next_in = (Bytef*)pbase();
+        mStream.avail_in = (uInt)(pptr() - pbase());
+        do {
+            mStream.next_out = (Bytef*)mOut.data();
+            mStream.avail_out = (uInt)mOut.size();
+            deflate(&mStream, flush);
+            out.write(mOut.data(), mOut.size() - mStream.avail_out);
+        } while (mStream.avail_out == 0);
+        setp(mIn.data(), mIn.data() + mIn.size());
+    }
+
+    ostream& out;
+    const char* encoding;
+    z_stream mStream;
+    bool mReady = false;
+    bool mStarted = false;
+    bool mFinished = false;
+    std::vector<char> mIn;
+    std::vector<char> mOut;
+};
+#endif
+
+#endif
@@ -0,0 +1,229 @@
+//-------------------------------------------------------------------------------------------------
+//  wxserver.cpp      Created by dennis.lang on 17-Oct-2026
+//  Copyright © 2026 Dennis Lang. All rights reserved.
+//-------------------------------------------------------------------------------------------------
+// This file is part of llwxjson project.
+//
+// Persistent server on a local Unix socket. Saves process startup and page
+// faults on every request. Protocol is one request per connection:
+//    client sends   query line, same as CGI QUERY_STRING, ex: site=data/wx.json\n
+//    server sends   response (Content-type header and json) then closes
+//                   or "Status: 500" error response if the request failed
+// A front end (httpd, nginx, socat) forwards each http request. Reads and
+// writes time out so idle clients cannot hold workers, and connections
+// over MAX_PENDING waiting get "Status: 503" and are closed.
+//
+
+#ifndef wxserver_cpp
+#define wxserver_cpp
+
+// Project files
+#include "json.hpp"
+
+#include <functional>
+#include <iostream>
+
+#ifndef HAVE_WIN
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Write response for query to out, false if request failed.
+typedef std::function<bool(const string& query, ostream& out)> WxHandler;
+
+class WxServer {
+public:
+    static const size_t MAX_QUERY = 4096;
+    static const size_t MAX_PENDING = 1024;     // accepted, waiting for a worker
+    static const int IO_TIMEOUT_SEC = 5;
+
+    WxServer(WxHandler _handler, bool _verbose) : handler(_handler), verbose(_verbose) {
+    }
+
+    // Accept requests on socketPath until the listen socket fails.
+    bool run(const char* socketPath, unsigned threads) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(socketPath) >= sizeof(addr.sun_path)) {
+            cerr << "Socket path too long " << socketPath << endl;
+            return false;
+        }
+        strcpy(addr.sun_path, socketPath);
+
+        int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+        unlink(socketPath);
+        if (listenFd < 0 || bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(listenFd, 128) != 0) {
+            cerr << strerror(errno) << ", Unable to listen on " << socketPath << endl;
+            if (listenFd >= 0)
+                close(listenFd);
+            return false;
+        }
+        signal(SIGPIPE, SIG_IGN);     // client gone, write() returns EPIPE
+
+        threads = std::max(threads, 1u);
+        std::vector<std::thread> workers;
+        for (unsigned idx = 0; idx < threads; idx++) {
+            workers.push_back(std::thread(&WxServer::work, this));
+        }
+        if (verbose) cerr << "Listening on " << socketPath << " threads=" << threads << endl;
+
+        for (;;) {
+            int fd = accept(listenFd, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR || errno == ECONNABORTED)
+                    continue;
+                cerr << strerror(errno) << ", Accept failed" << endl;
+                break;
+            }
+            struct timeval timeout = { IO_TIMEOUT_SEC, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (mPending.size() >= MAX_PENDING) {
+                static const char BUSY[] = "Status: 503 Service Unavailable\nContent-type: text/plain\n\nServer busy\n";
+                send(fd, BUSY, sizeof(BUSY) - 1, MSG_DONTWAIT);
+                close(fd);
+                cerr << "busy, pending=" << mPending.size() << "\n";
+                continue;
+            }
+            mPending.push_back(Request { fd, Clock::now() });
+            mReady.notify_one();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mDone = true;
+            mReady.notify_all();
+        }
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        close(listenFd);
+        unlink(socketPath);
+        return false;
+    }
+
+private:
+    typedef std::chrono::steady_clock Clock;
+    struct Request {
+        int fd;
+        Clock::time_point accepted;
+    };
+
+    void work() {
+        for (;;) {
+            Request request;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mReady.wait(lock, [this] { return mDone || ! mPending.empty(); });
+                if (mPending.empty())
+                    return;
+                request = mPending.front();
+                mPending.pop_front();
+            }
+            serve(request);
+        }
+    }
+
+    void serve(const Request& request) {
+        Clock::time_point started = Clock::now();
+        string query;
+        bool ok = readQuery(request.fd, query);
+        std::ostringstream response;
+        string error;
+        if (ok) {
+            try {
+                ok = handler(query, response);
+            } catch (const exception& ex) {
+                error = ex.what();
+                ok = false;
+            }
+        }
+        if (! ok) {
+            // Partial output is dropped, the client gets an error response.
+            response.str(string());
+            response << "Status: 500 Internal Server Error\nContent-type: text/plain\n\n"
+                << "Unable to convert " << query << (error.empty() ? "" : ", ") << error << "\n";
+        }
+        const string& body = response.str();
+        ok = writeAll(request.fd, body.data(), body.length()) && ok;
+        close(request.fd);
+
+        Clock::time_point finished = Clock::now();
+        using std::chrono::duration_cast;
+        using std::chrono::microseconds;
+        std::ostringstream log;
+        log << (ok ? "ok " : "failed ") << query
+            << " bytes=" << body.length()
+            << " wait=" << duration_cast<microseconds>(started - request.accepted).count() << "us"
+            << " run=" << duration_cast<microseconds>(finished - started).count() << "us\n";
+        cerr << log.str();
+    }
+
+    // Read request line, up to newline or end of input. False if empty or
+    // the client stalled past IO_TIMEOUT_SEC.
+    static bool readQuery(int fd, string& query) {
+        char chunk[512];
+        while (query.length() < MAX_QUERY) {
+            ssize_t got = read(fd, chunk, sizeof(chunk));
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                query.erase(std::min(query.find_first_of("\r\n"), query.length()));
+                return false;
+            }
+            if (got <= 0)
+                break;
+            query.append(chunk, got);
+            if (memchr(chunk, '\n', got) != nullptr)
+                break;
+        }
+        query.erase(std::min(query.find_first_of("\r\n"), query.length()));
+        return ! query.empty();
+    }
+
+    static bool writeAll(int fd, const char* data, size_t len) {
+        while (len != 0) {
+            ssize_t wrote = write(fd, data, len);
+            if (wrote < 0) {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += wrote;
+            len -= wrote;
+        }
+        return true;
+    }
+
+    WxHandler handler;
+    bool verbose;
+    std::mutex mMutex;
+    std::condition_variable mReady;
+    std::deque<Request> mPending;
+    bool mDone = false;
+};
+#endif
+
+// ---------------------------------------------------------------------------
+// Serve requests on Unix socket socketPath, only returns on failure.
+static bool JsonWxServe(const char* socketPath, unsigned threads, std::function<bool(const string&, ostream&)> handler, bool verbose) {
+#ifdef HAVE_WIN
+    cerr << "Server mode not supported on Windows" << endl;
+    return false;
+#else
+    WxServer server(handler, verbose);
+    return server.run(socketPath, threads);
+#endif
+}
+
+#endif
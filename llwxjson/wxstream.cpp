@@ -0,0 +1,382 @@
+//-------------------------------------------------------------------------------------------------
+//  wxstream.cpp      Created by dennis.lang on 17-Oct-2026
+//  Copyright © 2026 Dennis Lang. All rights reserved.
+//-------------------------------------------------------------------------------------------------
+// This file is part of llwxjson project.
+//
+// Streaming relative time rewrite. Input bytes are copied to the output as
+// they are read, only the scalar values of time fields are replaced. No tree
+// is built, memory is bounded by nesting depth plus the bytes held back until
+// the reference time is known. The reference is picked as findRefEpoch does,
+// the first value of the most preferred REF_FIELDS name, so output is held
+// until that name is seen or no more preferred name can follow (end of input).
+//
+
+#ifndef wxstream_cpp
+#define wxstream_cpp
+
+// Project files
+#include "json.hpp"
+#include "wxupdate.cpp"
+
+#include <fcntl.h>
+#ifdef HAVE_WIN
+#include <io.h>
+#define open _open
+#define read _read
+#define close _close
+#else
+#include <unistd.h>
+#endif
+
+class WxStream {
+public:
+    static const size_t CHUNK_SIZE = 64 * 1024;
+    static const size_t MAX_TOKEN = 128;    // longer values are never times
+
+    WxStream(ostream& _out, bool _verbose, Epoch_t now = 0, WxPrefix _prefix = nullptr)
+        : out(_out), verbose(_verbose), prefix(_prefix), ctx(mArena, nullptr, now) {
+    }
+
+    // Copy fd to output, rewriting time fields. False if no reference time.
+    bool run(int fd) {
+        std::vector<char> chunk(CHUNK_SIZE);
+        for (;;) {
+            long got = read(fd, chunk.data(), (unsigned)chunk.size());
+            if (got < 0) {
+                if (errno == EINTR)
+                    continue;
+                cerr << strerror(errno) << ", Read failed" << endl;
+                return false;
+            }
+            if (got == 0)
+                break;
+            scan(chunk.data(), chunk.data() + got);
+            if (mFailed)
+                return false;
+            if (ctx.refEpoch != 0) {
+                flush();
+            }
+        }
+        endToken();
+        if (mRefPending >= 0) {
+            setRef(0);
+        }
+        chooseRef(true);
+
+        if (mFailed)
+            return false;
+        if (ctx.refEpoch == 0) {
+            std::cerr << "Missing any of these: validTimeUtc, validTimeLocal, fcst_valid, fcst_valid_local, fcstValidLocal, obsTimeLocal" << endl;
+            return false;
+        }
+        flush();
+        return true;
+    }
+
+private:
+    static const size_t REF_COUNT = sizeof(REF_FIELDS) / sizeof(REF_FIELDS[0]) - 1;
+    enum RefState : uint8_t { RefUnseen, RefPending, RefDone };
+
+    // Open object or array, field applies to scalars directly inside it.
+    struct Frame {
+        char type;          // '{' or '['
+        WxField field;
+        bool expectKey;
+    };
+    // Time value held in output before the reference time was known.
+    struct Span {
+        size_t pos;
+        size_t len;
+        WxField field;
+    };
+    enum Token { NoToken, KeyToken, StringToken, BareToken };
+
+    void scan(const char* ptr, const char* endPtr) {
+        const char* runPtr = ptr;   // start of bytes not yet copied to output
+        while (ptr < endPtr) {
+            char chr = *ptr;
+            if (mToken == KeyToken || mToken == StringToken) {
+                if (mEscape) {
+                    mEscape = false;
+                } else if (chr == '\\') {
+                    mEscape = true;
+                } else if (chr == '"') {
+                    append(runPtr, ptr);
+                    runPtr = ptr;
+                    endToken();
+                    ptr++;
+                    continue;
+                }
+                ptr++;
+                continue;
+            }
+            if (mToken == BareToken) {
+                if (isBareChr(chr)) {
+                    ptr++;
+                    continue;
+                }
+                append(runPtr, ptr);
+                runPtr = ptr;
+                endToken();
+            }
+
+            switch (chr) {
+            case '{':
+            case '[':
+                push(chr);
+                break;
+            case '}':
+            case ']':
+                if (mRefPending >= 0) {
+                    setRef(0);      // empty array
+                }
+                if (! mStack.empty()) {
+                    mStack.pop_back();
+                }
+                break;
+            case ',':
+                if (! mStack.empty() && mStack.back().type == '{') {
+                    mStack.back().expectKey = true;
+                }
+                break;
+            case ':':
+                if (! mStack.empty()) {
+                    mStack.back().expectKey = false;
+                }
+                break;
+            case '"':
+                ptr++;
+                append(runPtr, ptr);
+                runPtr = ptr;
+                startToken((! mStack.empty() && mStack.back().expectKey) ? KeyToken : StringToken);
+                continue;
+            default:
+                if (isBareChr(chr)) {
+                    append(runPtr, ptr);
+                    runPtr = ptr;
+                    startToken(BareToken);
+                }
+                break;
+            }
+            ptr++;
+        }
+        append(runPtr, ptr);
+    }
+
+    static bool isBareChr(char chr) {
+        return chr != ',' && chr != ']' && chr != '}' && chr != ' ' && chr != '\t'
+            && chr != '\n' && chr != '\r' && chr != ':' && chr != '"';
+    }
+
+    void push(char type) {
+        if (mRefPending >= 0) {
+            // Reference is the value or the first array item, see getEpochFrom.
+            if (type == '[' && ! mRefArray) {
+                mRefArray = true;
+            } else {
+                setRef(0);
+            }
+        }
+        Frame frame = { type, FieldNone, type == '{' };
+        if (! mStack.empty() && mStack.back().field != FieldNone) {
+            // Time fields hold a value or an array of values, same as tree update.
+            if (type == '{' || mStack.back().type == '[') {
+                if (! mFailed) {
+                    cerr << "Not a time value, field " << mFieldKey << endl;
+                }
+                mFailed = true;
+            } else {
+                // Array elements take the field of the key which holds the array.
+                frame.field = mStack.back().field;
+            }
+        }
+        mStack.push_back(frame);
+    }
+
+    // Value held back for rewrite, or key collected for classification.
+    bool holding() const {
+        if (mToken == KeyToken || (mToken != NoToken && mRefPending >= 0))
+            return true;
+        if (mToken == NoToken || mStack.empty())
+            return false;
+        return mStack.back().field != FieldNone;
+    }
+
+    // First value of a reference name parsed, 0 if not a time.
+    void setRef(Epoch_t epoch) {
+        mRefState[mRefPending] = RefDone;
+        mRefEpoch[mRefPending] = epoch;
+        mRefPending = -1;
+        chooseRef(false);
+    }
+
+    // Most preferred reference with a time, once no more preferred name can follow.
+    void chooseRef(bool atEnd) {
+        if (ctx.refEpoch != 0)
+            return;
+        for (size_t idx = 0; idx < REF_COUNT; idx++) {
+            if (mRefState[idx] != RefDone) {
+                if (atEnd)
+                    continue;
+                return;
+            }
+            if (mRefEpoch[idx] != 0) {
+                ctx.refEpoch = mRefEpoch[idx];
+                ctx.days.preload(ctx.refEpoch, ctx.offset());
+                return;
+            }
+        }
+    }
+
+    void startToken(Token token) {
+        mToken = token;
+        mEscape = false;
+        mText.clear();
+        mHold = holding();
+    }
+
+    // Copy bytes to output, or to the held token text.
+    void append(const char* from, const char* to) {
+        if (from == to)
+            return;
+        if (mToken != NoToken && mHold) {
+            mText.append(from, to - from);
+            if (mText.length() > MAX_TOKEN) {
+                mHold = false;
+                mOut.append(mText);
+                mText.clear();
+            }
+        } else {
+            mOut.append(from, to - from);
+        }
+    }
+
+    void endToken() {
+        Token token = mToken;
+        mToken = NoToken;
+        if (token == NoToken)
+            return;
+        if (token == KeyToken) {
+            Frame& frame = mStack.back();
+            frame.field = FieldNone;
+            if (mHold) {
+                mOut.append(mText);
+                frame.field = wxRules().find(mText.data(), mText.length());
+                if (frame.field != FieldNone) {
+                    mFieldKey = mText;
+                }
+                // Only the first of each reference name counts, as index.first().
+                for (size_t idx = 0; idx < REF_COUNT; idx++) {
+                    if (mRefState[idx] == RefUnseen && mText == REF_FIELDS[idx].name) {
+                        mRefState[idx] = RefPending;
+                        mRefPending = (int)idx;
+                        mRefArray = false;
+                        break;
+                    }
+                }
+            }
+            return;
+        }
+        if (! mHold) {
+            if (mRefPending >= 0) {
+                setRef(0);      // too long to be a time
+            }
+            return;
+        }
+
+        const Frame& frame = mStack.back();
+        JsonValue value(mText.data(), mText.length());
+        value.scalar = (token == StringToken) ? JsonString : JsonValue::classify(mText.data(), mText.length());
+        if (mRefPending >= 0) {
+            setRef(REF_FIELDS[mRefPending].parseFunc(ctx, value));
+        }
+        if (frame.field == FieldNone) {
+            mOut.append(mText);
+        } else if (ctx.refEpoch == 0) {
+            mSpans.push_back(Span { mOut.length(), mText.length(), frame.field });
+            mOut.append(mText);
+        } else {
+            if (! mSpans.empty()) {
+                resolve();
+            }
+            rewrite(value, frame.field);
+            mOut.append(value.data(), value.length());
+        }
+    }
+
+    void rewrite(JsonValue& value, WxField field) {
+        const WxFieldFuncs& funcs = FIELD_FUNCS[field];
+        Epoch_t time = funcs.parseFunc(ctx, value);
+        if (time != 0) {
+            funcs.setFunc(ctx, value, time + ctx.offset());
+        }
+    }
+
+    // Reference time now known, rewrite values held in the output.
+    void resolve() {
+        string held;
+        held.swap(mOut);
+        size_t pos = 0;
+        for (const Span& span : mSpans) {
+            mOut.append(held, pos, span.pos - pos);
+            JsonValue value(held.data() + span.pos, span.len);
+            rewrite(value, span.field);
+            mOut.append(value.data(), value.length());
+            pos = span.pos + span.len;
+        }
+        mOut.append(held, pos, string::npos);
+        mSpans.clear();
+    }
+
+    void flush() {
+        if (! mSpans.empty()) {
+            resolve();
+        }
+        if (prefix != nullptr) {
+            prefix(out);        // before the first output
+            prefix = nullptr;
+        }
+        out.write(mOut.data(), mOut.length());
+        out.flush();
+        mOut.clear();
+        mArena.clear();
+    }
+
+    ostream& out;
+    bool verbose;
+    WxPrefix prefix;
+    JsonArena mArena;           // storage for rewritten values
+    WxContext ctx;
+    std::vector<Frame> mStack;
+    std::vector<Span> mSpans;
+    string mOut;                // pending output
+    string mText;               // held token text
+    string mFieldKey;           // last time field name, for errors
+    RefState mRefState[REF_COUNT] = {};
+    Epoch_t mRefEpoch[REF_COUNT] = {};
+    int mRefPending = -1;       // REF_FIELDS index whose value is next
+    bool mRefArray = false;     // pending reference is inside its array
+    Token mToken = NoToken;
+    bool mEscape = false;
+    bool mHold = false;
+    bool mFailed = false;       // time field holds a map or nested array
+};
+
+// ---------------------------------------------------------------------------
+// Stream file (or stdin for "-") to out, rewriting times relative to now.
+static bool JsonWxStream(const string& filepath, ostream& out, bool verbose, Epoch_t now = 0, WxPrefix prefix = nullptr) {
+    int fd = (filepath == "-") ? 0 : open(filepath.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << strerror(errno) << ", Unable to open " << filepath << endl;
+        return false;
+    }
+    WxStream stream(out, verbose, now, prefix);
+    bool ok = stream.run(fd);
+    if (fd != 0) {
+        close(fd);
+    }
+    return ok;
+}
+
+#endif
@@ -0,0 +1,233 @@
+//-------------------------------------------------------------------------------------------------
+//  wxtemplate.cpp      Created by dennis.lang on 17-Oct-2026
+//  Copyright © 2026 Dennis Lang. All rights reserved.
+//-------------------------------------------------------------------------------------------------
+// This file is part of llwxjson project.
+//
+// Precompiled output templates. -compile parses a source file once and
+// saves the output text with a table of every time value in it. -render
+// maps the template and only shifts those values, no json parsing.
+//
+// Template file <source>.wxt, native byte order:
+//    WxTemplateHeader
+//    WxTemplateSpan[spanCount]    ascending offset
+//    output text[textLen]
+//
+
+#ifndef wxtemplate_cpp
+#define wxtemplate_cpp
+
+// Project files
+#include "json.hpp"
+#include "wxupdate.cpp"
+
+#include <cstdio>
+#include <fstream>
+#include <sys/stat.h>
+
+static const char WX_TEMPLATE_MAGIC[8] = { 'L', 'L', 'W', 'X', 'T', 'P', 'L', '1' };
+static const char* WX_TEMPLATE_EXT = ".wxt";
+
+struct WxTemplateHeader {
+    char magic[8];
+    uint64_t srcSize;           // source file size and modify time,
+    int64_t srcMtime;           // template is stale if either changes, nanoseconds
+    int64_t refEpoch;
+    uint64_t spanCount;
+    uint64_t textLen;
+};
+
+struct WxTemplateSpan {
+    uint64_t offset;            // value in output text
+    uint32_t length;
+    uint32_t field;             // WxField
+    int64_t epoch;              // parsed value
+};
+
+// Modify time in nanoseconds, seconds where finer time is not available.
+static int64_t modifyTime(const struct stat& fileStat) {
+#if defined(__APPLE__)
+    return (int64_t)fileStat.st_mtimespec.tv_sec * 1000000000 + fileStat.st_mtimespec.tv_nsec;
+#elif defined(HAVE_WIN)
+    return (int64_t)fileStat.st_mtime * 1000000000;
+#else
+    return (int64_t)fileStat.st_mtim.tv_sec * 1000000000 + fileStat.st_mtim.tv_nsec;
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// Call func for the value, or each value of an array.
+template <typename Func>
+static void forEachValue(JsonBase* ptr, Func func) {
+    if (ptr->is(JsonBase::Array)) {
+        for (JsonBase* item : ptr->asArray()) {
+            if (item->is(JsonBase::Value))
+                func(item->asValue());
+        }
+    } else if (ptr->is(JsonBase::Value)) {
+        func(ptr->asValue());
+    }
+}
+
+// Tag every time value with its field kind, values are not changed.
+static void markTimes(WxContext& ctx, const JsonIndex& index) {
+    const WxRules& rules = wxRules();
+    for (const auto& item : index.nodes()) {
+        WxField field = rules.find(item.first);
+        if (field == FieldNone)
+            continue;
+        for (JsonBase* ptr : item.second) {
+            forEachValue(ptr, [&](JsonValue& value) {
+                if (FIELD_FUNCS[field].parseFunc(ctx, value) != 0) {
+                    value.tag = (uint8_t)field;
+                }
+            });
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Write template for parsed source, splice keeps the source text,
+// otherwise text is written in style.
+static bool JsonWxCompile(JsonBuffer& buffer, JsonFields& base, const string& srcPath, bool splice, JsonStyle style, bool verbose) {
+    WxContext ctx(buffer.arena);
+    if (base.at("") == nullptr)
+        return false;
+    if (buffer.index == nullptr) {
+        buffer.enableIndex().addTree(base.at(""));
+    }
+    if (! findRefEpoch(ctx, *buffer.index, verbose))
+        return false;
+    markTimes(ctx, *buffer.index);
+
+    // Output text and the position of each tagged value in it.
+    std::vector<JsonWriter::Span> spans;
+    std::ostringstream text;
+    if (splice) {
+        for (const auto& item : buffer.index->nodes()) {
+            for (JsonBase* ptr : item.second) {
+                forEachValue(ptr, [&](JsonValue& value) {
+                    if (value.tag != 0) {
+                        spans.push_back(JsonWriter::Span { size_t(value.data() - buffer.data()), &value });
+                    }
+                });
+            }
+        }
+        std::sort(spans.begin(), spans.end(), [](const JsonWriter::Span& lhs, const JsonWriter::Span& rhs) {
+            return lhs.offset < rhs.offset;
+        });
+        text.write(buffer.data(), buffer.size());
+    } else {
+        JsonWriter writer(text, style);
+        writer.spans = &spans;
+        writer.write(*base.at(""));
+    }
+    const string& textStr = text.str();
+
+    struct stat srcStat;
+    if (stat(srcPath.c_str(), &srcStat) != 0) {
+        if (verbose) cerr << strerror(errno) << ", Unable to stat " << srcPath << endl;
+        return false;
+    }
+    WxTemplateHeader header;
+    memcpy(header.magic, WX_TEMPLATE_MAGIC, sizeof(header.magic));
+    header.srcSize = (uint64_t)srcStat.st_size;
+    header.srcMtime = modifyTime(srcStat);
+    header.refEpoch = ctx.refEpoch;
+    header.spanCount = spans.size();
+    header.textLen = textStr.length();
+
+    std::vector<WxTemplateSpan> table;
+    table.reserve(spans.size());
+    for (const JsonWriter::Span& span : spans) {
+        JsonValue& value = (JsonValue&)*span.value;
+        WxField field = (WxField)value.tag;
+        table.push_back(WxTemplateSpan { span.offset, (uint32_t)value.length(), (uint32_t)field,
+            FIELD_FUNCS[field].parseFunc(ctx, value) });
+    }
+
+    // Write beside source, rename so readers never see a partial template.
+    string tplPath = srcPath + WX_TEMPLATE_EXT;
+    string tmpPath = tplPath + ".tmp";
+    {
+        std::ofstream tpl(tmpPath.c_str(), std::ios::binary | std::ios::trunc);
+        tpl.write((const char*)&header, sizeof(header));
+        tpl.write((const char*)table.data(), table.size() * sizeof(WxTemplateSpan));
+        tpl.write(textStr.data(), textStr.length());
+        if (! tpl.good()) {
+            if (verbose) cerr << strerror(errno) << ", Unable to write " << tmpPath << endl;
+            remove(tmpPath.c_str());
+            return false;
+        }
+    }
+#ifdef HAVE_WIN
+    remove(tplPath.c_str());
+#endif
+    if (rename(tmpPath.c_str(), tplPath.c_str()) != 0) {
+        if (verbose) cerr << strerror(errno) << ", Unable to rename " << tmpPath << endl;
+        remove(tmpPath.c_str());
+        return false;
+    }
+    if (verbose) cerr << "Compiled " << tplPath << " spans=" << spans.size() << " bytes=" << textStr.length() << endl;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Template of a source file, usable only if load() succeeds.
+class WxTemplate {
+public:
+    // Map template of srcPath, false if missing, invalid or stale.
+    bool load(const string& srcPath, bool verbose) {
+        string tplPath = srcPath + WX_TEMPLATE_EXT;
+        struct stat srcStat;
+        if (stat(srcPath.c_str(), &srcStat) != 0 || ! mBuffer.load(tplPath.c_str()))
+            return false;
+        if (mBuffer.size() < sizeof(WxTemplateHeader))
+            return invalid(tplPath, verbose);
+        memcpy(&mHeader, mBuffer.data(), sizeof(mHeader));
+        if (memcmp(mHeader.magic, WX_TEMPLATE_MAGIC, sizeof(mHeader.magic)) != 0
+            || mHeader.spanCount > (mBuffer.size() - sizeof(mHeader)) / sizeof(WxTemplateSpan)
+            || sizeof(mHeader) + mHeader.spanCount * sizeof(WxTemplateSpan) + mHeader.textLen != mBuffer.size())
+            return invalid(tplPath, verbose);
+        if (mHeader.srcSize != (uint64_t)srcStat.st_size || mHeader.srcMtime != modifyTime(srcStat)) {
+            if (verbose) cerr << "Stale template " << tplPath << endl;
+            return false;
+        }
+        mSpans = (const WxTemplateSpan*)(mBuffer.data() + sizeof(mHeader));
+        mText = mBuffer.data() + sizeof(mHeader) + mHeader.spanCount * sizeof(WxTemplateSpan);
+        return true;
+    }
+
+    // Emit text with every time value shifted relative to now.
+    void render(ostream& out, Epoch_t now = 0) {
+        WxContext ctx(mBuffer.arena, nullptr, now);
+        ctx.refEpoch = mHeader.refEpoch;
+        ctx.days.preload(ctx.refEpoch, ctx.offset());
+
+        JsonSplices splices;
+        splices.reserve(mHeader.spanCount);
+        const char* textEnd = mText + mHeader.textLen;
+        for (uint64_t idx = 0; idx < mHeader.spanCount; idx++) {
+            const WxTemplateSpan& span = mSpans[idx];
+            if (span.field >= FieldCount || span.field == FieldNone || span.offset + span.length > mHeader.textLen)
+                continue;
+            JsonValue* value = mBuffer.arena.make<JsonValue>(mText + span.offset, span.length);
+            FIELD_FUNCS[span.field].setFunc(ctx, *value, span.epoch + ctx.offset());
+            splices.push_back(JsonSplice { mText + span.offset, span.length, value });
+        }
+        JsonSpliceDump(mText, textEnd, splices, out);
+    }
+
+private:
+    bool invalid(const string& tplPath, bool verbose) {
+        if (verbose) cerr << "Invalid template " << tplPath << endl;
+        return false;
+    }
+
+    JsonBuffer mBuffer;         // mapped template, arena holds shifted values
+    WxTemplateHeader mHeader;
+    const WxTemplateSpan* mSpans = nullptr;
+    const char* mText = nullptr;
+};
+
+#endif
@@ -13,22 +13,22 @@
 #include "json.hpp"
 
 #include <iostream>
+#include <fstream>
 #include <sstream>
 #include <iomanip>
 #include <locale.h>
 #include <time.h>
 #include <cstdlib>
 #include <string>
+#include <chrono>
+
+#ifndef HAVE_WIN
+#include <sys/resource.h>
+#endif
 
 typedef time_t Epoch_t;
-typedef struct tm Tm_t;
 typedef unsigned int uint;
 
-static Tm_t TM; // conversion
-static Epoch_t now;
-static Tm_t nowTm;
-static Epoch_t refEpoch;    // Reference time from Weather Json.
-
 static const char* DOW[] = { "Sunday", "Monday", "Tuesday", "Wednesday", "Thursday", "Friday", "Saturday", nullptr } ;
 static const uint SECS_PER_DAY = 24 * 60 * 60;
 static const uint SECS_PER_HOUR = 60 * 60;
@@ -36,10 +36,10 @@ static const uint SECS_PER_MIN = 60;
 
 
 static const uint NO_MATCH = -1;
-static uint indexOf(const char** array, const char* want, uint defIdx) {
+static uint indexOf(const char** array, const char* want, size_t wantLen, uint defIdx) {
     uint idx = 0;
     while (array[idx] != nullptr) {
-        if (strcasecmp(array[idx], want) == 0)
+        if (strncasecmp(array[idx], want, wantLen) == 0 && array[idx][wantLen] == '\0')
             return idx;
         idx++;
     }
@@ -99,193 +99,695 @@ static const char* FIELD_DOW[] = { "dayOfWeek", "dow", nullptr };
 // MonthDay - Almanac
 static const char* FIELD_MDAY[] = { "almanacRecordDate", nullptr };
 
-static Tm_t& toGmtTm(const Epoch_t epoch) {
-    // localtime_r(&epoch, &TM);
-    gmtime_r(&epoch, &TM);
-    return TM;
+// ---------------------------------------------------------------------------
+// Calendar conversion without libc, no timezone state or locks. Proleptic
+// Gregorian calendar, http://howardhinnant.github.io/date_algorithms.html
+static inline int64_t floorDiv(int64_t num, int64_t den) {
+    int64_t quot = num / den;
+    return quot - ((num % den) < 0);
 }
-static Epoch_t toEpoch(Tm_t& time) {
-#ifdef HAVE_WIN
-    // https://stackoverflow.com/questions/13804095/get-the-time-zone-gmt-offset-in-c
-    const std::time_t epoch_plus_11h = 60 * 60 * 11;
-    const int local_time = localtime(&epoch_plus_11h)->tm_hour;
-    const int gm_time = gmtime(&epoch_plus_11h)->tm_hour;
-    const int tm_gmtoff = local_time - gm_time;
-
-    time.tm_sec -= tm_gmtoff;
-    return _mkgmtime(&time);
-#else
-    // return mktime(&time);           // Assumes local timezone, same as timelocal
-    time.tm_sec -= time.tm_gmtoff;
-    time.tm_gmtoff = 0;
-    return timegm(&time);            // Assumes GMT (ignores gmt offset)
-    // return timelocal(&time);            // Support gmt offset
-#endif
+
+static inline int64_t daysFromCivil(int64_t year, uint month, uint day) {
+    year -= (month <= 2);
+    const int64_t era = floorDiv(year, 400);
+    const uint yoe = (uint)(year - era * 400);                          // [0, 399]
+    const uint doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;  // [0, 365]
+    const uint doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;             // [0, 146096]
+    return era * 146097 + doe - 719468;
 }
-static Epoch_t toEpochDay(const Tm_t& day, Epoch_t epochHHMMSS) {
-    Tm_t tm = toGmtTm(epochHHMMSS);    // hour, minute, seconds, etc
-    tm.tm_year = day.tm_year;
-    tm.tm_mon = day.tm_mon;
-    tm.tm_mday = day.tm_mday;
-    return toEpoch(tm);
+
+// Calendar fields of one day.
+struct WxDay {
+    int64_t day = INT64_MIN;    // days since 1970-01-01
+    Epoch_t midnight = 0;
+    int year = 0;
+    uint month = 0;             // 1..12
+    uint mday = 0;              // 1..31
+    uint wday = 0;              // 0=Sunday
+};
+
+static void civilFromDays(int64_t days, WxDay& civil) {
+    civil.day = days;
+    civil.midnight = days * SECS_PER_DAY;
+    civil.wday = (uint)(days - floorDiv(days + 4, 7) * 7 + 4);         // 1970-01-01 was Thursday
+
+    const int64_t zdays = days + 719468;
+    const int64_t era = floorDiv(zdays, 146097);
+    const uint doe = (uint)(zdays - era * 146097);                      // [0, 146096]
+    const uint yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;  // [0, 399]
+    const uint doy = doe - (365 * yoe + yoe / 4 - yoe / 100);           // [0, 365]
+    const uint mp = (5 * doy + 2) / 153;                                // [0, 11]
+    civil.mday = doy - (153 * mp + 2) / 5 + 1;
+    civil.month = (mp < 10) ? mp + 3 : mp - 9;
+    civil.year = (int)(yoe + era * 400 + (civil.month <= 2));
 }
 
-static const char ISO8601_HHCMM[] = "%04d-%02d-%02dT%02d:%02d:%02d+00:00";
-static const char ISO8601_HHMM[] = "%04d-%02d-%02dT%02d:%02d:%02d+0000";
+// Day table, direct mapped by day number. A document only spans a handful
+// of days so after the first value of each day conversions are a lookup.
+// The reference from at() is only valid until the next at() call.
+class WxDays {
+public:
+    static const uint SLOTS = 64;
+
+    const WxDay& at(Epoch_t epoch) {
+        int64_t day = floorDiv(epoch, SECS_PER_DAY);
+        WxDay& entry = mDays[(uint64_t)day % SLOTS];
+        if (entry.day != day) {
+            civilFromDays(day, entry);
+        }
+        return entry;
+    }
+
+    // Fill days around the reference time, before and after the shift.
+    void preload(Epoch_t refEpoch, Epoch_t offset) {
+        for (int day = -1; day <= 16; day++) {
+            at(refEpoch + day * (Epoch_t)SECS_PER_DAY);
+            at(refEpoch + offset + day * (Epoch_t)SECS_PER_DAY);
+        }
+    }
+
+private:
+    WxDay mDays[SLOTS];
+};
 
-static string& toISO8601(string& out, Epoch_t epoch) {
-    char buffer [80];
+// ---------------------------------------------------------------------------
+// Per request rewrite state.
+struct WxContext {
+    Epoch_t now;
+    Epoch_t refEpoch = 0;       // Reference time from Weather Json.
+    JsonArena& arena;           // Storage for rewritten values.
+    JsonSplices* splices;       // Rewritten spans for splice output, null if unused.
+    WxDays days;
+
+    // Zero _now uses the current time.
+    WxContext(JsonArena& _arena, JsonSplices* _splices = nullptr, Epoch_t _now = 0) :
+        now(_now != 0 ? _now : std::time(0)), arena(_arena), splices(_splices) {
+    }
+    Epoch_t offset() const {
+        return now - refEpoch;
+    }
+};
+
+// ---------------------------------------------------------------------------
+// Fixed width decimal digits, bad is set if any character is not a digit.
+static inline uint parseDigits2(const char* str, uint& bad) {
+    uint d0 = (unsigned char)str[0] - '0';
+    uint d1 = (unsigned char)str[1] - '0';
+    bad |= (d0 > 9) | (d1 > 9);
+    return d0 * 10 + d1;
+}
+static inline uint parseDigits4(const char* str, uint& bad) {
+    return parseDigits2(str, bad) * 100 + parseDigits2(str + 2, bad);
+}
+
+static const char DIGIT_PAIRS[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static inline char* putDigits2(char* out, uint num) {
+    memcpy(out, DIGIT_PAIRS + num * 2, 2);
+    return out + 2;
+}
+static inline char* putDigits4(char* out, uint num) {
+    return putDigits2(putDigits2(out, num / 100 % 100), num % 100);
+}
+
+// ---------------------------------------------------------------------------
+static const size_t ISO8601_MAX = 25;
+
+// Format epoch as UTC, colon in zone offset if prior value was long form.
+// Buffer needs ISO8601_MAX bytes, returns length written.
+static size_t toISO8601(char* buffer, size_t prevLen, Epoch_t epoch, WxDays& days) {
     // 01234567890123456789012345
     // 2020-03-31T18:00:00-04:10    length=25
     // 2020-03-31T18:00:00-0410     length=24
-    Tm_t gmTime = toGmtTm(epoch);
-    snprintf(buffer, sizeof(buffer),
-        (out.length() > 24) ? ISO8601_HHCMM : ISO8601_HHMM,
-        gmTime.tm_year + 1900,
-        gmTime.tm_mon + 1,
-        gmTime.tm_mday,
-        gmTime.tm_hour,
-        gmTime.tm_min,
-        gmTime.tm_sec);
-    out = buffer;
-    return out;
+    const WxDay& civil = days.at(epoch);
+    uint secs = (uint)(epoch - civil.midnight);
+    char* out = putDigits4(buffer, (uint)civil.year);
+    *out++ = '-';
+    out = putDigits2(out, civil.month);
+    *out++ = '-';
+    out = putDigits2(out, civil.mday);
+    *out++ = 'T';
+    out = putDigits2(out, secs / SECS_PER_HOUR);
+    *out++ = ':';
+    out = putDigits2(out, secs / SECS_PER_MIN % 60);
+    *out++ = ':';
+    out = putDigits2(out, secs % SECS_PER_MIN);
+    if (prevLen > 24) {
+        memcpy(out, "+00:00", 6);
+        out += 6;
+    } else {
+        memcpy(out, "+0000", 5);
+        out += 5;
+    }
+    return out - buffer;
 }
-
-inline int parseInt(const char* value) {
-    return (int)strtol(value, nullptr, 10);
+static string& toISO8601(string& out, Epoch_t epoch) {
+    char buffer[ISO8601_MAX];
+    WxDays days;
+    out.assign(buffer, toISO8601(buffer, out.length(), epoch, days));
+    return out;
 }
 
 // 0123456789012345678901234
 // 2020-03-31T18:00:00-04:10
-static Epoch_t parseISO8601(const string& value, Tm_t& time) {
-    bzero(&time, sizeof(time));
-    if (value.length() > 19) {
-        const char* str = value.c_str();
-        time.tm_year = parseInt(str + 0) - 1900;
-        time.tm_mon = parseInt(str + 5) - 1;
-        time.tm_mday = parseInt(str + 8);
-        time.tm_hour = parseInt(str + 11);
-        time.tm_min = parseInt(str + 14);
-        time.tm_sec = parseInt(str + 17);
-
-        long gmtOffsetHours = parseInt(str + 19); //   "+/-HH:MM"  or  "+/-HHMM"
-        long gmtOffsetMins = 0;
-        const char* tzMinPtr = strchr(str + 19, ':');
-
-        if (tzMinPtr != nullptr) {
-            long sign = (gmtOffsetHours == 0) ? 1 : abs(gmtOffsetHours) / gmtOffsetHours;
-            gmtOffsetMins = parseInt(tzMinPtr + 1) * sign;
-        } else {
-            gmtOffsetMins = gmtOffsetHours % 100;
-            gmtOffsetHours /= 100;
+// 2020-03-31T18:00:00-0410
+// Returns 0 if not a time.
+static Epoch_t parseISO8601(const char* str, size_t len) {
+    if (len < 19)
+        return 0;
+    uint bad = 0;
+    uint year = parseDigits4(str + 0, bad);
+    uint month = parseDigits2(str + 5, bad);
+    uint day = parseDigits2(str + 8, bad);
+    uint hour = parseDigits2(str + 11, bad);
+    uint min = parseDigits2(str + 14, bad);
+    uint sec = parseDigits2(str + 17, bad);
+    if (bad != 0 || month - 1 > 11)
+        return 0;
+
+    // Optional zone offset "+/-HH:MM", "+/-HHMM", "+/-HH" or "Z".
+    int gmtOffset = 0;
+    const char* tzPtr = str + 19;
+    const char* endPtr = str + len;
+    while (tzPtr < endPtr && (*tzPtr == '.' || (uint)(*tzPtr - '0') <= 9)) {
+        tzPtr++;    // fraction of seconds
+    }
+    if (tzPtr + 3 <= endPtr && (*tzPtr == '+' || *tzPtr == '-')) {
+        uint offHour = parseDigits2(tzPtr + 1, bad);
+        uint offMin = 0;
+        const char* minPtr = tzPtr + 3 + (tzPtr + 3 < endPtr && tzPtr[3] == ':');
+        if (minPtr + 2 <= endPtr) {
+            offMin = parseDigits2(minPtr, bad);
+        }
+        if (bad != 0)
+            return 0;
+        gmtOffset = (int)(offHour * SECS_PER_HOUR + offMin * SECS_PER_MIN);
+        if (*tzPtr == '-') {
+            gmtOffset = -gmtOffset;
         }
-#ifdef HAVE_WIN
-        time.tm_sec += gmtOffsetHours * SECS_PER_HOUR + gmtOffsetMins * SECS_PER_MIN;
-#else
-        time.tm_gmtoff = gmtOffsetHours * SECS_PER_HOUR + gmtOffsetMins * SECS_PER_MIN;
-        time.tm_isdst = 0;
-        return toEpoch(time);
-#endif
     }
-    return 0;
+    return daysFromCivil(year, month, day) * SECS_PER_DAY
+        + hour * SECS_PER_HOUR + min * SECS_PER_MIN + sec - gmtOffset;
+}
+
+static Epoch_t parseISO8601(WxContext&, JsonValue& value) {
+    return parseISO8601(value.data(), value.length());
 }
 
-static Epoch_t parseISO8601(JsonValue& value) {
-    Tm_t time;
-    return parseISO8601(value, time);
+// Replace value with text built directly in the document arena.
+template <typename Format>
+static void setFormatted(WxContext& ctx, JsonValue& value, size_t maxLen, Format format) {
+    char* buffer = ctx.arena.strAlloc(maxLen);
+    size_t len = format(buffer);
+    buffer[len] = '\0';
+    value.set(buffer, len);
 }
 
-static void setISO8601(JsonValue& value, Epoch_t epoch) {
-    toISO8601(value, epoch);
+static void setISO8601(WxContext& ctx, JsonValue& value, Epoch_t epoch) {
+    size_t prevLen = value.length();
+    setFormatted(ctx, value, ISO8601_MAX, [&](char* buffer) {
+        return toISO8601(buffer, prevLen, epoch, ctx.days);
+    });
+}
+// Keep time of day, move to the day of epochDay.
+static Epoch_t toEpochDay(WxContext& ctx, Epoch_t epochDay, Epoch_t epochHour) {
+    Epoch_t dayMidnight = ctx.days.at(epochDay).midnight;
+    Epoch_t hourMidnight = ctx.days.at(epochHour).midnight;
+    return dayMidnight + (epochHour - hourMidnight);
 }
-static void setISO8601Day(JsonValue& value, Epoch_t epochDay) {
-    Epoch_t epochHour = parseISO8601(value);
-    Epoch_t epoch = toEpochDay(toGmtTm(epochDay), epochHour);
-    toISO8601(value, epoch);
+static void setISO8601Day(WxContext& ctx, JsonValue& value, Epoch_t epochDay) {
+    setISO8601(ctx, value, toEpochDay(ctx, epochDay, parseISO8601(ctx, value)));
 }
-static Epoch_t parseEpoch(JsonValue& value) {
-    return std::strtoul(value.c_str(), nullptr, 10);
+static Epoch_t parseEpoch(WxContext&, JsonValue& value) {
+    if (value.scalar == JsonInt) {
+        Epoch_t epoch = (Epoch_t)value.asInt();
+        return (epoch > 0) ? epoch : 0;
+    }
+    // Quoted or other text, parse leading digits.
+    Epoch_t epoch = 0;
+    const char* endPtr = value.data() + value.length();
+    for (const char* ptr = value.data(); ptr < endPtr && (uint)(*ptr - '0') <= 9; ptr++) {
+        epoch = epoch * 10 + (*ptr - '0');
+    }
+    return epoch;
 }
-static void setEpoch(JsonValue& value, Epoch_t epoch) {
-    string str = to_string(epoch);
-    value = str;
+static void setEpoch(WxContext& ctx, JsonValue& value, Epoch_t epoch) {
+    JsonScalar scalar = value.scalar;
+    value.setInt(epoch, ctx.arena);
+    value.scalar = scalar;      // quoted epochs stay quoted
 }
-static void setEpochDay(JsonValue& value, Epoch_t epochDay) {
-    Epoch_t epochHour = parseEpoch(value);
-    Epoch_t epoch = toEpochDay(toGmtTm(epochDay), epochHour);
-    string str = to_string(epoch);
-    value = str;
+static void setEpochDay(WxContext& ctx, JsonValue& value, Epoch_t epochDay) {
+    setEpoch(ctx, value, toEpochDay(ctx, epochDay, parseEpoch(ctx, value)));
 }
-static Epoch_t parseDOW(JsonValue& value) {
-    Tm_t tm = toGmtTm(refEpoch);
-    uint dayOfWeek = indexOf(DOW, value.c_str(), NO_MATCH);
-    return refEpoch + (dayOfWeek - tm.tm_wday) * SECS_PER_DAY;
+static Epoch_t parseDOW(WxContext& ctx, JsonValue& value) {
+    uint dow = indexOf(DOW, value.data(), value.length(), NO_MATCH);
+    return ctx.refEpoch + (dow - ctx.days.at(ctx.refEpoch).wday) * SECS_PER_DAY;
 }
-static void setDOW(JsonValue& value, Epoch_t epoch) {
-    Tm_t tm = toGmtTm(epoch);
-    value = DOW[tm.tm_wday];
+static void setDOW(WxContext& ctx, JsonValue& value, Epoch_t epoch) {
+    const char* name = DOW[ctx.days.at(epoch).wday];
+    value.set(name, strlen(name));
 }
 
-typedef Epoch_t (*ParseTime)(JsonValue& value);
-typedef void SetTime(JsonValue& value, Epoch_t epoch);
+typedef Epoch_t (*ParseTime)(WxContext& ctx, JsonValue& value);
+typedef void SetTime(WxContext& ctx, JsonValue& value, Epoch_t epoch);
+
+// Set time and remember the replaced span of the input.
+static void setTime(WxContext& ctx, JsonValue& value, SetTime setFunc, Epoch_t epoch) {
+    const char* orig = value.data();
+    size_t len = value.length();
+    setFunc(ctx, value, epoch);
+    if (ctx.splices != nullptr) {
+        ctx.splices->push_back(JsonSplice { orig, len, &value });
+    }
+}
 
 // ---------------------------------------------------------------------------
-static void update(const char* name, JsonArray& array, Epoch_t offset, ParseTime parseFunc, SetTime setFunc, bool verbose) {
+// False if an item is an array or map, items before it are already set.
+static bool update(WxContext& ctx, const JsonValue& name, JsonArray& array, ParseTime parseFunc, SetTime setFunc, bool verbose) {
     for (JsonBase* itemPtr : array) {
+        if (! itemPtr->is(JsonBase::Value))
+            return false;
         JsonValue& value = itemPtr->asValue();
-        Epoch_t time = parseFunc(value);
+        Epoch_t time = parseFunc(ctx, value);
         if (time != 0) {
-            setFunc(value, time + offset);
+            setTime(ctx, value, setFunc, time + ctx.offset());
         } else if (verbose) {
             cerr << "Empty time in array " << name << " value=" << value << endl;
         }
     }
+    return true;
 }
 
 // ---------------------------------------------------------------------------
-static void update(const char** names, JsonFields& base, Epoch_t offset, ParseTime parseFunc, SetTime setFunc, bool verbose) {
-    while (*names) {
-        const JsonBase* prevPtr = nullptr;
-        JsonBase* ptr = (JsonBase*) base.at("")->find(*names, prevPtr);
-        if (ptr != nullptr) {
-            while(ptr != nullptr) {
-                switch (ptr->mJtype) {
-                case JsonBase::Array:
-                    update(*names, ptr->asArray(), offset, parseFunc, setFunc, verbose);
-                    break;
-                case JsonBase::Value: {
-                    JsonValue& value = ptr->asValue();
-                    Epoch_t time = parseFunc(value);
-                    if (time != 0) {
-                        if (verbose) cerr << "set " << *names << " from=" << value;
-                        setFunc(value, time + offset);
-                        if (verbose) cerr << " to=" << value << endl;
-                    }
+// Time field kinds, one per rule table.
+enum WxField { FieldNone, FieldEpoch, FieldEpochDay, FieldIso, FieldIsoDay, FieldDow, FieldCount };
+
+struct WxFieldFuncs {
+    const char* name;       // kind name used in rules file
+    const char** builtin;   // built-in field names
+    ParseTime parseFunc;
+    SetTime* setFunc;
+};
+static const WxFieldFuncs FIELD_FUNCS[FieldCount] = {
+    { "none",     nullptr,         nullptr,        nullptr },
+    { "epoch",    FIELD_EPOCH,     &parseEpoch,    &setEpoch },
+    { "epochDay", FIELD_EPOCH_DAY, &parseEpoch,    &setEpochDay },
+    { "iso",      FIELD_ISO,       &parseISO8601,  &setISO8601 },
+    { "isoDay",   FIELD_ISO_DAY,   &parseISO8601,  &setISO8601Day },
+    { "dow",      FIELD_DOW,       &parseDOW,      &setDOW },
+};
+
+// ---------------------------------------------------------------------------
+// Per document counters for -stats, one json line per document.
+struct WxStats {
+    enum Phase { Load, Parse, Update, Output, PhaseCount };
+    struct Time {
+        uint64_t wallNs = 0;
+        uint64_t cpuNs = 0;
+    };
+
+    Time phases[PhaseCount];
+    size_t bytes = 0;
+    size_t nodes[JsonBase::Raw + 1] = {};       // by Jtype
+    size_t matched[FieldCount] = {};            // values under each rule table's names
+    size_t allocCount = 0;
+    size_t allocBytes = 0;
+    size_t blockCount = 0;
+    bool cacheHit = false;
+
+    static Time now() {
+        Time time;
+        time.wallNs = (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#ifdef HAVE_WIN
+        time.cpuNs = (uint64_t)std::clock() * (1000000000 / CLOCKS_PER_SEC);
+#else
+        struct timespec cpu;
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+        time.cpuNs = (uint64_t)cpu.tv_sec * 1000000000 + cpu.tv_nsec;
+#endif
+        return time;
+    }
+
+    void add(Phase phase, const Time& started) {
+        Time ended = now();
+        phases[phase].wallNs += ended.wallNs - started.wallNs;
+        phases[phase].cpuNs += ended.cpuNs - started.cpuNs;
+    }
+
+    void countNodes(const JsonBase* node) {
+        nodes[node->mJtype]++;
+        if (const JsonArray* array = node->asArrayPtr()) {
+            for (const JsonBase* item : *array) {
+                countNodes(item);
+            }
+        } else if (const JsonMap* map = node->asMapPtr()) {
+            for (const JsonMember& member : *map) {
+                countNodes(member.second);
+            }
+        }
+    }
+
+    void setArena(const JsonArena& arena) {
+        allocCount = arena.allocCount;
+        allocBytes = arena.allocBytes;
+        blockCount = arena.blockCount;
+    }
+
+    // Peak resident set of the process, in KB.
+    static long peakRssKB() {
+#ifdef HAVE_WIN
+        return 0;
+#else
+        struct rusage usage;
+        if (getrusage(RUSAGE_SELF, &usage) != 0)
+            return 0;
+#ifdef __APPLE__
+        return usage.ru_maxrss / 1024;      // bytes on macOS
+#else
+        return usage.ru_maxrss;
+#endif
+#endif
+    }
+
+    string toJson(const string& file, bool ok) const {
+        static const char* PHASE_NAMES[PhaseCount] = { "load", "parse", "update", "output" };
+        std::ostringstream line;
+        line << "{\"file\":\"";
+        for (char chr : file) {
+            if (chr == '"' || chr == '\\')
+                line << '\\';
+            line << chr;
+        }
+        line << "\",\"ok\":" << (ok ? "true" : "false")
+            << ",\"cacheHit\":" << (cacheHit ? "true" : "false")
+            << ",\"bytes\":" << bytes
+            << ",\"nodes\":{\"value\":" << nodes[JsonBase::Value]
+            << ",\"array\":" << nodes[JsonBase::Array]
+            << ",\"map\":" << nodes[JsonBase::Map]
+            << ",\"raw\":" << nodes[JsonBase::Raw] << "}"
+            << ",\"phases\":{";
+        for (int phase = 0; phase < PhaseCount; phase++) {
+            line << (phase != 0 ? "," : "") << '"' << PHASE_NAMES[phase] << "\":{\"wallNs\":" << phases[phase].wallNs
+                << ",\"cpuNs\":" << phases[phase].cpuNs << "}";
+        }
+        line << "},\"arena\":{\"allocs\":" << allocCount << ",\"bytes\":" << allocBytes
+            << ",\"blocks\":" << blockCount << "}"
+            << ",\"keys\":" << JsonKeys::count()
+            << ",\"matched\":{";
+        for (int field = FieldEpoch; field < FieldCount; field++) {
+            line << (field != FieldEpoch ? "," : "") << '"' << FIELD_FUNCS[field].name << "\":" << matched[field];
+        }
+        line << "},\"peakRssKB\":" << peakRssKB() << "}\n";
+        return line.str();
+    }
+};
+
+// Time the enclosing scope as phase, no-op without stats.
+class WxPhase {
+public:
+    WxPhase(WxStats* _stats, WxStats::Phase _phase) : stats(_stats), phase(_phase) {
+        if (stats != nullptr)
+            started = WxStats::now();
+    }
+    ~WxPhase() {
+        if (stats != nullptr)
+            stats->add(phase, started);
+    }
+private:
+    WxStats* stats;
+    WxStats::Phase phase;
+    WxStats::Time started;
+};
+
+// ---------------------------------------------------------------------------
+// Field name to WxField lookup using a perfect hash. Built once at startup
+// from the built-in lists plus an optional rules file, after which every
+// lookup is one hash and at most one compare.
+class WxRules {
+public:
+    WxRules() {
+        for (uint field = FieldEpoch; field < FieldCount; field++) {
+            for (const char** names = FIELD_FUNCS[field].builtin; *names; names++) {
+                add(*names, (WxField)field);
+            }
+        }
+        build();
+    }
+
+    // Add or replace rule, call build() when done.
+    void add(const char* name, WxField field) {
+        for (Rule& rule : mRules) {
+            if (rule.name == name) {
+                rule.field = field;
+                return;
+            }
+        }
+        mRules.push_back(Rule { name, field });
+    }
+
+    // Load rules file, one "kind fieldName" per line, # comments.
+    //   epoch    validTimeUtc
+    //   isoDay   sunriseTimeLocal
+    bool load(const char* path, bool verbose) {
+        std::ifstream in(path);
+        if (! in.good()) {
+            if (verbose) cerr << strerror(errno) << ", Unable to open rules " << path << endl;
+            return false;
+        }
+        string line;
+        uint lineNum = 0;
+        while (std::getline(in, line)) {
+            lineNum++;
+            std::istringstream words(line.substr(0, line.find('#')));
+            string kind, name;
+            if (! (words >> kind))
+                continue;
+            uint field = FieldEpoch;
+            while (field < FieldCount && strcasecmp(FIELD_FUNCS[field].name, kind.c_str()) != 0) {
+                field++;
+            }
+            if (field == FieldCount || ! (words >> name)) {
+                cerr << "Invalid rule at " << path << ":" << lineNum << " " << line << endl;
+                return false;
+            }
+            add(name.c_str(), (WxField)field);
+        }
+        build();
+        return true;
+    }
+
+    WxField find(const char* name, size_t len) const {
+        uint16_t slot = mTable[hash(name, len, mSeed) & mMask];
+        if (slot != 0) {
+            const Rule& rule = mRules[slot - 1];
+            if (rule.name.length() == len && memcmp(rule.name.data(), name, len) == 0)
+                return rule.field;
+        }
+        return FieldNone;
+    }
+    WxField find(const JsonValue& name) const {
+        if (name.isKey()) {
+            uint32_t id = name.keyId();
+            return (id < mByKey.size()) ? (WxField)mByKey[id] : FieldNone;
+        }
+        return find(name.data(), name.length());
+    }
+
+    // Changes if any rule changes, part of cached output keys.
+    uint32_t digest() const {
+        uint32_t digest = 0;
+        for (const Rule& rule : mRules) {
+            digest = hash(rule.name.data(), rule.name.length(), digest ^ rule.field) * 31;
+        }
+        return digest;
+    }
+
+private:
+    struct Rule {
+        string name;
+        WxField field;
+    };
+
+    static uint32_t hash(const char* str, size_t len, uint32_t seed) {
+        uint32_t hash = 2166136261U ^ seed;
+        for (size_t idx = 0; idx < len; idx++) {
+            hash = (hash ^ (unsigned char)str[idx]) * 16777619U;
+        }
+        return hash ^ (hash >> 15);
+    }
+
+    // Search for a seed which places every rule in its own slot, and
+    // resolve rules by key id. Keys interned later can not be rules.
+    void build() {
+        mByKey.clear();
+        for (const Rule& rule : mRules) {
+            JsonValue name(rule.name.data(), rule.name.length());
+            JsonKeys::intern(name);
+            if (name.isKey()) {
+                mByKey.resize(std::max(mByKey.size(), size_t(name.keyId()) + 1), FieldNone);
+                mByKey[name.keyId()] = (uint8_t)rule.field;
+            }
+        }
+
+        size_t tableSize = 16;
+        while (tableSize < mRules.size() * 2) {
+            tableSize *= 2;
+        }
+        for (;;) {
+            mMask = (uint32_t)tableSize - 1;
+            for (mSeed = 1; mSeed < 10000; mSeed++) {
+                mTable.assign(tableSize, 0);
+                bool collide = false;
+                for (size_t idx = 0; idx < mRules.size() && ! collide; idx++) {
+                    uint16_t& slot = mTable[hash(mRules[idx].name.data(), mRules[idx].name.length(), mSeed) & mMask];
+                    collide = (slot != 0);
+                    slot = (uint16_t)(idx + 1);
                 }
-                break;
-                case JsonBase::Map:
-                case JsonBase::None:
-                    assert(false);
-                    abort();
+                if (! collide)
+                    return;
+            }
+            tableSize *= 2;
+        }
+    }
+
+    std::vector<Rule> mRules;
+    std::vector<uint16_t> mTable;     // rule index + 1, 0 is empty
+    std::vector<uint8_t> mByKey;      // WxField by key id
+    uint32_t mSeed = 0;
+    uint32_t mMask = 0;
+};
+
+static WxRules& wxRules() {
+    static WxRules rules;
+    return rules;
+}
+
+// Reference time fields, in order of preference.
+struct WxRef {
+    const char* name;
+    ParseTime parseFunc;
+};
+static const WxRef REF_FIELDS[] = {
+    { "validTimeUtc",     &parseEpoch },
+    { "validTimeLocal",   &parseISO8601 },
+    { "fcst_valid",       &parseEpoch },
+    { "fcst_valid_local", &parseISO8601 },
+    { "fcstValidLocal",   &parseISO8601 },
+    { "obsTimeLocal",     &parseISO8601 },
+    { nullptr,            nullptr }
+};
+
+// ---------------------------------------------------------------------------
+// Epoch and iso arrays of one form (all quoted or not, iso zone written
+// the same way) are parsed into a JsonPacked column and shifted with one
+// add, JsonWriter formats them on output. Day fields keep the time of
+// day so they are not a plain shift, splice output needs each value.
+static const size_t PACK_MIN = 8;       // smaller arrays are set in place
+
+static size_t formatEpoch(const JsonPacked&, int64_t epoch, char* buffer) {
+    return JsonValue::formatInt(epoch, buffer);
+}
+static size_t formatISO8601(const JsonPacked& packed, int64_t epoch, char* buffer) {
+    static thread_local WxDays days;    // server and batch workers write concurrently
+    return toISO8601(buffer, packed.flags, epoch, days);
+}
+
+static bool pack(WxContext& ctx, JsonArray& array, WxField field) {
+    if (ctx.splices != nullptr || array.size() < PACK_MIN || (field != FieldEpoch && field != FieldIso))
+        return false;
+    if (! array.front()->is(JsonBase::Value))
+        return false;
+    const JsonValue& first = array.front()->asValue();
+    bool quoted = first.isQuoted();
+    bool longZone = first.length() > 24;
+    ParseTime parseFunc = FIELD_FUNCS[field].parseFunc;
+
+    JsonPacked* packed = ctx.arena.make<JsonPacked>(ctx.arena, (field == FieldIso) ? &formatISO8601 : &formatEpoch, quoted);
+    packed->flags = longZone ? 25 : 24;    // toISO8601 prevLen
+    packed->values.resize(array.size());
+    for (size_t idx = 0; idx < array.size(); idx++) {
+        JsonBase* item = array[idx];
+        if (! item->is(JsonBase::Value) || item->asValue().isQuoted() != quoted
+            || (field == FieldIso && (item->asValue().length() > 24) != longZone)) {
+            return false;
+        }
+        Epoch_t time = parseFunc(ctx, item->asValue());
+        if (time == 0)
+            return false;
+        packed->values[idx] = time;
+    }
+    packed->add(ctx.offset());
+    array.packed = packed;
+    return true;
+}
+
+// Apply rule to a value or array of values, false if the field holds a
+// map or an array with a nested array or map, which is not a time.
+static bool update(WxContext& ctx, const JsonValue& name, JsonBase* ptr, WxField field, bool verbose) {
+    const WxFieldFuncs& funcs = FIELD_FUNCS[field];
+    switch (ptr->mJtype) {
+    case JsonBase::Array:
+        if (! pack(ctx, ptr->asArray(), field)) {
+            return update(ctx, name, ptr->asArray(), funcs.parseFunc, funcs.setFunc, verbose);
+        }
+        break;
+    case JsonBase::Value: {
+        JsonValue& value = ptr->asValue();
+        Epoch_t time = funcs.parseFunc(ctx, value);
+        if (time != 0) {
+            if (verbose) cerr << "set " << name << " from=" << value;
+            setTime(ctx, value, funcs.setFunc, time + ctx.offset());
+            if (verbose) cerr << " to=" << value << endl;
+        }
+    }
+    break;
+    case JsonBase::Map:
+    case JsonBase::Raw:
+    case JsonBase::None:
+        return false;
+    }
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// Single pass over the field index, each distinct field name is classified
+// once and only its nodes are visited. False if a time field holds
+// something other than times.
+static bool update(WxContext& ctx, const JsonIndex& index, bool verbose, WxStats* stats = nullptr) {
+    const WxRules& rules = wxRules();
+    for (const auto& item : index.nodes()) {
+        WxField field = rules.find(item.first);
+        if (field != FieldNone) {
+            for (JsonBase* ptr : item.second) {
+                if (! update(ctx, item.first, ptr, field, verbose)) {
+                    cerr << "Not a time value, field " << item.first << endl;
+                    return false;
+                }
+                if (stats != nullptr) {
+                    stats->matched[field] += ptr->is(JsonBase::Array) ? ptr->asArray().size() : 1;
                 }
-                prevPtr = ptr;
-                ptr = (JsonBase*) base.at("")->find(*names, prevPtr);
             }
         }
-        names++;
     }
+    return true;
 }
 
 // ---------------------------------------------------------------------------
-static Epoch_t getEpochFrom(const JsonBase* cptr, ParseTime parseFunc) {
+static Epoch_t getEpochFrom(WxContext& ctx, const JsonBase* cptr, ParseTime parseFunc) {
     JsonBase* ptr = (JsonBase*)cptr;
     if (ptr != nullptr) {
         if (ptr->is(JsonBase::Array) ) {
+            if (ptr->asArray().empty())
+                return 0;
             ptr = ptr->asArray().at(0);
         }
         const JsonValue* valPtr = ptr->asValuePtr();
         if (valPtr != nullptr) {
-            return parseFunc((JsonValue&) * valPtr);
+            return parseFunc(ctx, (JsonValue&) * valPtr);
         }
     }
     return 0;
@@ -295,23 +797,18 @@ static const char* defaultIf(const char* value, const char* defValue) {
     return (value != nullptr) ? value : defValue;
 }
 
-static void dumpTm(const Tm_t& time) {
-    cout << "\n   Year=" << time.tm_year
-        << "\nYearDay=" << time.tm_yday
-        << "\n  Month=" << time.tm_mon
-        << "\n    Day=" << time.tm_mday
-        << "\n    DOW=" << time.tm_mday
-        << "\n  Hours=" << time.tm_hour
-        << "\nMinutes=" << time.tm_min
-        << "\nSeconds=" << time.tm_sec
-#ifdef HAVE_WIN
-#else
-        << "\nGMT off=" << time.tm_gmtoff << ", " << setprecision(2) << (float)time.tm_gmtoff / SECS_PER_HOUR << "hr"
-        << "\n     TZ=" << time.tm_zone
-#endif
+static void dumpTm(Epoch_t epoch) {
+    WxDays days;
+    const WxDay& time = days.at(epoch);
+    uint secs = (uint)(epoch - time.midnight);
+    cout << "\n   Year=" << time.year
+        << "\n  Month=" << time.month
+        << "\n    Day=" << time.mday
+        << "\n    DOW=" << DOW[time.wday]
+        << "\n  Hours=" << secs / SECS_PER_HOUR
+        << "\nMinutes=" << secs / SECS_PER_MIN % 60
+        << "\nSeconds=" << secs % SECS_PER_MIN
         << endl;
-
-    // int    tm_isdst;    /* Daylight Savings Time flag */
 }
 // ---------------------------------------------------------------------------
 static void JsonTest() {
@@ -319,57 +816,81 @@ static void JsonTest() {
     string s1 = "2020-02-03T08:01:02-01:00";
     string s2 = "2020-02-03T08:01:02+01:00";
 
-    Tm_t time1, time2;
-    Epoch_t t1 = parseISO8601(s1, time1);
-    Epoch_t t2 = parseISO8601(s2, time2);
+    Epoch_t t1 = parseISO8601(s1.c_str(), s1.length());
+    Epoch_t t2 = parseISO8601(s2.c_str(), s2.length());
 
     string out1, out2;
     cout << s1 << " converted to=" << toISO8601(out1, t1) << endl;
-    dumpTm(time1);
+    dumpTm(t1);
     cout << s2 << " converted to=" << toISO8601(out2, t2) << endl;
-    dumpTm(time2);
+    dumpTm(t2);
     cout << "[done]\n";
 }
 
 // ---------------------------------------------------------------------------
-static bool JsonWxRelative(JsonFields& base, ostream& out, bool verbose) {
-    now = std::time(0);
-    nowTm = toGmtTm(now);
+// ---------------------------------------------------------------------------
+// Set ctx.refEpoch from the first reference field found, false if none.
+static bool findRefEpoch(WxContext& ctx, const JsonIndex& index, bool verbose) {
+    for (const WxRef* ref = REF_FIELDS; ref->name != nullptr; ref++) {
+        ctx.refEpoch = getEpochFrom(ctx, index.first(ref->name), ref->parseFunc);
+        if (ctx.refEpoch != 0) {
+            if (verbose) cerr << "Reference " << ref->name << "=" << ctx.refEpoch << " offset=" << ctx.offset() << endl;
+            return true;
+        }
+    }
+    std::cerr << "Missing any of these: validTimeUtc, validTimeLocal, fcst_valid, fcst_valid_local, fcstValidLocal, obsTimeLocal" << endl;
+    return false;
+}
+
+// ---------------------------------------------------------------------------
+// Lazy parse filter, rule fields and reference fields are kept.
+static bool wxKeepKey(const char* name, size_t len) {
+    if (wxRules().find(name, len) != FieldNone)
+        return true;
+    for (const WxRef* ref = REF_FIELDS; ref->name != nullptr; ref++) {
+        if (strncmp(ref->name, name, len) == 0 && ref->name[len] == '\0')
+            return true;
+    }
+    return false;
+}
+
+// Response header writer, called only once output is known to succeed.
+typedef void (*WxPrefix)(ostream& out);
+
+// ---------------------------------------------------------------------------
+// Splice keeps the input layout, otherwise output is written in style.
+static bool JsonWxRelative(JsonBuffer& buffer, JsonFields& base, ostream& out, bool verbose, bool splice = false,
+    JsonStyle style = JsonClassic, Epoch_t now = 0, WxStats* stats = nullptr, WxPrefix prefix = nullptr) {
+    WxContext ctx(buffer.arena, splice ? &buffer.splices : nullptr, now);
 
     if (base.at("") != NULL) {
-        refEpoch = 0;
+        {
+            WxPhase phase(stats, WxStats::Update);
+            if (buffer.index == nullptr) {
+                buffer.enableIndex().addTree(base.at(""));
+            }
+            const JsonIndex& index = *buffer.index;
 
-        const JsonBase* prevPtr = nullptr;
-        refEpoch = getEpochFrom(base.at("")->find("validTimeUtc", prevPtr), &parseEpoch);
-        if (refEpoch == 0) {
-            refEpoch = getEpochFrom(base.at("")->find("validTimeLocal", prevPtr), &parseISO8601);
-        }
-        if (refEpoch == 0) {
-            refEpoch = getEpochFrom(base.at("")->find("fcst_valid", prevPtr), &parseEpoch);
-        }
-        if (refEpoch == 0) {
-            refEpoch = getEpochFrom(base.at("")->find("fcst_valid_local", prevPtr), &parseISO8601);
-        }
-        if (refEpoch == 0) {
-            refEpoch = getEpochFrom(base.at("")->find("fcstValidLocal", prevPtr), &parseISO8601);
+            if (! findRefEpoch(ctx, index, verbose)) {
+                return false;
+            }
+
+            ctx.days.preload(ctx.refEpoch, ctx.offset());
+            if (! update(ctx, index, verbose, stats)) {
+                return false;
+            }
+            // update(FIELD_MDAY, base, offset, &parseMDay, &setMDay, verbose);
         }
-        if (refEpoch == 0) {
-            refEpoch = getEpochFrom(base.at("")->find("obsTimeLocal", prevPtr), &parseISO8601);
+
+        WxPhase phase(stats, WxStats::Output);
+        if (prefix != nullptr) {
+            prefix(out);
         }
-        if (refEpoch == 0 ) {
-            if (verbose) std::cerr << "Missing any of these: validTimeUtc, validTimeLocal, fcst_valid, fcst_valid_local, fcstValidLocal, obsTimeLocal" << endl;
-            return false;
+        if (splice) {
+            JsonSpliceDump(buffer, out);
+        } else {
+            JsonDump(base, out, style);
         }
-
-        Epoch_t offset = now - refEpoch;
-        update(FIELD_EPOCH, base, offset, &parseEpoch, &setEpoch, verbose);
-        update(FIELD_EPOCH_DAY, base, offset, &parseEpoch, &setEpochDay, verbose);
-        update(FIELD_ISO, base, offset, &parseISO8601, &setISO8601, verbose);
-        update(FIELD_ISO_DAY, base, offset, &parseISO8601, &setISO8601Day, verbose);
-        update(FIELD_DOW, base, offset, &parseDOW, &setDOW, verbose);
-        // update(FIELD_MDAY, base, offset, &parseMDay, &setMDay, verbose);
-
-        JsonDump(base, out);
         return true;
     }
     return false;